@@ -3,8 +3,34 @@
 #include <SDL2/SDL_ttf.h>
 
 #include <cstdlib>
+#include <cstdio>
+#include <cstdarg>
 #include <algorithm>
 #include <iostream>
+#include <cmath>
+#include <climits>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <malloc.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// SIMD kernels of the alpha compositing, the widest one the compiler is
+// allowed to use (-mavx2, -march=native, /arch:AVX2); SSE2 on any x86-64
+#if defined(__AVX2__)
+#define GENV_AVX2 1
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define GENV_SSE2 1
+#include <emmintrin.h>
+#endif
 
 
 genv::groutput& genv::gout = genv::groutput::instance();
@@ -19,370 +45,4418 @@ namespace
     SDL_TimerID timer_id = 0;
     int timer_wait = 0;
 
-    inline Uint32& pixel(SDL_Surface* screen, int x, int y)
+    // pixel format of the window surface, once there is one
+    Uint32 native_format = SDL_PIXELFORMAT_RGB888;
+
+    // Pixel memory of the canvas surfaces, 64 byte aligned. Blocks up to
+    // 4 MiB come in power of two size classes and are kept for the next
+    // canvas of the class, up to 64 MiB in all. Larger ones are mapped
+    // directly (zeroed lazily by the system), on Linux with huge pages.
+    class pixel_pool
+    {
+    public:
+        pixel_pool() : cached(0) {}
+        void* get(std::size_t bytes);   // zeroed
+        void put(void* px);
+
+    private:
+        static const std::size_t header = 64;   // the block size, before the pixels
+        static const int min_class = 12, max_class = 22;
+        static const std::size_t max_cached = 64 << 20;
+
+        static void* allocate(std::size_t size, bool large);
+        static void release(void* block, std::size_t size, bool large);
+
+        std::vector<void*> free_blocks[max_class - min_class + 1];
+        std::size_t cached;
+    };
+
+    void* pixel_pool::allocate(std::size_t size, bool large)
+    {
+#ifdef _WIN32
+        if (large)
+            return VirtualAlloc(0, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        return _aligned_malloc(size, header);
+#else
+        if (large) {
+            void* p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED)
+                return 0;
+#ifdef MADV_HUGEPAGE
+            madvise(p, size, MADV_HUGEPAGE);
+#endif
+            return p;
+        }
+        void* p = 0;
+        return posix_memalign(&p, header, size) == 0 ? p : 0;
+#endif
+    }
+
+    void pixel_pool::release(void* block, std::size_t size, bool large)
+    {
+#ifdef _WIN32
+        if (large)
+            VirtualFree(block, 0, MEM_RELEASE);
+        else
+            _aligned_free(block);
+#else
+        if (large)
+            munmap(block, size);
+        else
+            std::free(block);
+#endif
+    }
+
+    void* pixel_pool::get(std::size_t bytes)
+    {
+        std::size_t size = bytes + header;
+        bool large = size > (std::size_t(1) << max_class);
+        unsigned char* block = 0;
+        if (large) {
+            block = static_cast<unsigned char*>(allocate(size, true));
+        } else {
+            int cls = min_class;
+            while ((std::size_t(1) << cls) < size)
+                ++cls;
+            size = std::size_t(1) << cls;
+            std::vector<void*>& list = free_blocks[cls - min_class];
+            if (!list.empty()) {
+                block = static_cast<unsigned char*>(list.back());
+                list.pop_back();
+                cached -= size;
+            } else {
+                block = static_cast<unsigned char*>(allocate(size, false));
+            }
+            if (block)
+                std::memset(block + header, 0, bytes);
+        }
+        if (block == 0)
+            return 0;
+        *reinterpret_cast<std::size_t*>(block) = size;
+        return block + header;
+    }
+
+    void pixel_pool::put(void* px)
+    {
+        unsigned char* block = static_cast<unsigned char*>(px) - header;
+        std::size_t size = *reinterpret_cast<std::size_t*>(block);
+        bool large = size > (std::size_t(1) << max_class);
+        if (large || cached + size > max_cached) {
+            release(block, size, large);
+            return;
+        }
+        int cls = min_class;
+        while ((std::size_t(1) << cls) < size)
+            ++cls;
+        free_blocks[cls - min_class].push_back(block);
+        cached += size;
+    }
+
+    // never destroyed: canvases may be freed after the other statics
+    pixel_pool& pool()
+    {
+        static pixel_pool* p = new pixel_pool;
+        return *p;
+    }
+
+    // Canvas surfaces: without blending, so that stamping them onto a surface
+    // of the same format is a plain copy. The pixels come from the pool, the
+    // pitch is padded to 64 bytes, so that every row is aligned.
+    SDL_Surface* create_surface(int w, int h, Uint32 format = native_format)
     {
-        return *((Uint32*)screen->pixels + y * screen->w + x);
+        std::size_t n = static_cast<std::size_t>(std::max(w, 0));
+        std::size_t row = SDL_BYTESPERPIXEL(format) ? n * SDL_BYTESPERPIXEL(format) : (n * SDL_BITSPERPIXEL(format) + 7) / 8;
+        std::size_t pitch = (row + 63) & ~std::size_t(63);
+        void* px = w > 0 && h > 0 ? pool().get(pitch * h) : 0;
+        SDL_Surface* s = px ? SDL_CreateRGBSurfaceWithFormatFrom(px, w, h, SDL_BITSPERPIXEL(format), static_cast<int>(pitch), format)
+                            : SDL_CreateRGBSurfaceWithFormat(0, w, h, SDL_BITSPERPIXEL(format), format);
+        if (px) {
+            if (s)
+                s->userdata = &pool();  // free_surface() gives the pixels back
+            else
+                pool().put(px);
+        }
+        if (s)
+            SDL_SetSurfaceBlendMode(s, SDL_BLENDMODE_NONE);
+        return s;
+    }
+
+    // for the surfaces of canvases, from create_surface() or elsewhere
+    void free_surface(SDL_Surface* s)
+    {
+        if (s == 0)
+            return;
+        void* px = s->refcount == 1 && s->userdata == &pool() ? s->pixels : 0;
+        SDL_FreeSurface(s);
+        if (px)
+            pool().put(px);
+    }
+
+    SDL_Surface* convert_surface(SDL_Surface* src, Uint32 format = native_format)
+    {
+        SDL_Surface* s = SDL_ConvertSurfaceFormat(src, format, 0);
+        if (s)
+            SDL_SetSurfaceBlendMode(s, SDL_BLENDMODE_NONE);
+        return s;
+    }
+
+    // Clips a blit of a w*h area from (sx,sy) of a sw*sh surface to (tx,ty)
+    // of a tw*th one, false if nothing is left.
+    bool clip_blit(int& sx, int& sy, int& w, int& h, int& tx, int& ty, int sw, int sh, int tw, int th)
+    {
+        if (sx < 0) { w += sx; tx -= sx; sx = 0; }
+        if (sy < 0) { h += sy; ty -= sy; sy = 0; }
+        w = std::min(w, sw - sx);
+        h = std::min(h, sh - sy);
+        if (tx < 0) { w += tx; sx -= tx; tx = 0; }
+        if (ty < 0) { h += ty; sy -= ty; ty = 0; }
+        w = std::min(w, tw - tx);
+        h = std::min(h, th - ty);
+        return w > 0 && h > 0;
+    }
+
+    // Clips a rectangle to a cw*ch area, false if nothing is left.
+    bool clip_rect(int& x, int& y, int& w, int& h, int cw, int ch)
+    {
+        if (x < 0) { w += x; x = 0; }
+        if (y < 0) { h += y; y = 0; }
+        w = std::min(w, cw - x);
+        h = std::min(h, ch - y);
+        return w > 0 && h > 0;
+    }
+
+    // Rows of 1 bit pixels, MSB first: n bits from bit x on set or cleared,
+    // and n bits copied (or ORed) from bit sx of src to bit dx of dst.
+    void set_bits(Uint8* row, int x, int n, bool on)
+    {
+        Uint8 v = on ? 0xff : 0;
+        for (; n > 0 && (x & 7); ++x, --n)
+            row[x >> 3] = static_cast<Uint8>(on ? row[x >> 3] | 0x80 >> (x & 7) : row[x >> 3] & ~(0x80 >> (x & 7)));
+        std::memset(row + (x >> 3), v, n >> 3);
+        x += n & ~7;
+        if (n & 7) {
+            Uint8 m = static_cast<Uint8>(0xff00 >> (n & 7));
+            row[x >> 3] = static_cast<Uint8>((row[x >> 3] & ~m) | (v & m));
+        }
     }
 
-    inline void project(SDL_Surface* screen, int draw_clr, int x, int y, int val, int max)
+    void copy_bits(const Uint8* src, int sx, Uint8* dst, int dx, int n, bool or_only = false)
     {
-        Uint32 &pix = pixel(screen, x, y);
-        static const int c[] = {0, 8, 16};
-        for (int i=0; i<3; ++i)
+        int i = 0;
+        if (((sx | dx) & 7) == 0) {
+            // whole bytes
+            const Uint8* s = src + (sx >> 3);
+            Uint8* d = dst + (dx >> 3);
+            if (or_only)
+                for (; i + 8 <= n; i += 8)
+                    *d++ |= *s++;
+            else if ((i = n & ~7) != 0)
+                std::memcpy(d, s, i >> 3);
+        }
+        for (; i < n; ++i)
         {
-            int col = ( ((pix >> c[i])      & 0xff) * (max-val) +
-                        ((draw_clr >> c[i]) & 0xff) * val) / max;
-            pix = (pix & (~(0xff << c[i]))) | (col << c[i]);
+            int b = (src[(sx + i) >> 3] >> (7 - ((sx + i) & 7))) & 1;
+            Uint8& t = dst[(dx + i) >> 3];
+            Uint8 m = static_cast<Uint8>(0x80 >> ((dx + i) & 7));
+            if (b)
+                t |= m;
+            else if (!or_only)
+                t = static_cast<Uint8>(t & ~m);
         }
     }
 
-    int findkey(pairptr begin, pairptr end, int key)
+    // bytes of the pixels of a row, without the padding
+    inline std::size_t row_bytes(const SDL_Surface* s)
     {
-        while (begin < end)
+        return s->format->BitsPerPixel < 8 ? (static_cast<std::size_t>(s->w) + 7) / 8
+                                           : static_cast<std::size_t>(s->w) * s->format->BytesPerPixel;
+    }
+
+    // Moves a clipped area of a surface within itself. Rows are copied in
+    // the order that keeps an overlapping source intact, memmove takes care
+    // of the overlap inside a row.
+    void move_rect(SDL_Surface* screen, int sx, int sy, int w, int h, int tx, int ty)
+    {
+        int bpp = screen->format->BytesPerPixel;
+        Uint8* px = static_cast<Uint8*>(screen->pixels);
+        if (screen->format->BitsPerPixel < 8) {
+            // 1 bit rows through a line, in the same order
+            std::vector<Uint8> line((w + 7) / 8);
+            for (int i = 0; i < h; ++i)
+            {
+                int y = ty > sy ? h - 1 - i : i;
+                copy_bits(px + (sy + y) * screen->pitch, sx, &line[0], 0, w);
+                copy_bits(&line[0], 0, px + (ty + y) * screen->pitch, tx, w);
+            }
+            return;
+        }
+        std::size_t len = static_cast<std::size_t>(w) * bpp;
+        if (ty > sy)
+            for (int y = h-1; y >= 0; --y)
+                std::memmove(px + (ty + y) * screen->pitch + tx * bpp, px + (sy + y) * screen->pitch + sx * bpp, len);
+        else if (ty < sy || tx != sx)
+            for (int y = 0; y < h; ++y)
+                std::memmove(px + (ty + y) * screen->pitch + tx * bpp, px + (sy + y) * screen->pitch + sx * bpp, len);
+    }
+
+    // the alpha of rgb (top byte) is used only with alpha, premultiplied;
+    // on 1 bit surfaces every color but black is 1
+    inline Uint32 map_rgb(SDL_Surface* screen, int rgb, bool alpha = false)
+    {
+        if (screen->format->BitsPerPixel == 1)
+            return (rgb & 0xffffff) != 0;
+        int r = (rgb >> 16) & 0xff, g = (rgb >> 8) & 0xff, b = rgb & 0xff;
+        if (!alpha)
+            return SDL_MapRGB(screen->format, r, g, b);
+        int a = (rgb >> 24) & 0xff;
+        return SDL_MapRGBA(screen->format, (r*a + 127) / 255, (g*a + 127) / 255, (b*a + 127) / 255, a);
+    }
+
+    // format of alpha canvases: that of the window with alpha in the spare
+    // byte, so that compositing onto the window needs no conversion
+    Uint32 alpha_format()
+    {
+        int bpp;
+        Uint32 r, g, b, a;
+        if (SDL_PixelFormatEnumToMasks(native_format, &bpp, &r, &g, &b, &a) && bpp == 32 &&
+            (r | g | b) == 0x00ffffff) {
+            Uint32 f = SDL_MasksToPixelFormatEnum(32, r, g, b, 0xff000000);
+            if (f != SDL_PIXELFORMAT_UNKNOWN)
+                return f;
+        }
+        return SDL_PIXELFORMAT_ARGB8888;
+    }
+
+    void premultiply(SDL_Surface* s)
+    {
+        for (int y = 0; y < s->h; ++y)
         {
-            pairptr med = begin + (end-begin)/2;
-            int mk = (*med)[0];
-            if (mk == key)
-                return (*med)[1];
-            else if (mk < key)
-                begin = med+1;
-            else
-                end = med;
+            Uint32* p = reinterpret_cast<Uint32*>(static_cast<Uint8*>(s->pixels) + y * s->pitch);
+            for (int x = 0; x < s->w; ++x)
+            {
+                Uint8 r, g, b, a;
+                SDL_GetRGBA(p[x], s->format, &r, &g, &b, &a);
+                p[x] = SDL_MapRGBA(s->format, (r*a + 127) / 255, (g*a + 127) / 255, (b*a + 127) / 255, a);
+            }
         }
-        return 0;
     }
 
-    int mkkeycode(int sym)
+    inline Uint8* pixel_row(SDL_Surface* s, int y)
     {
-        int mysym = findkey(keysym_tbl, keysym_end, sym);
-        if (mysym != 0) 
+        return static_cast<Uint8*>(s->pixels) + y * s->pitch;
+    }
+
+    inline const Uint8* pixel_row(const SDL_Surface* s, int y)
+    {
+        return static_cast<const Uint8*>(s->pixels) + y * s->pitch;
+    }
+
+    // Pixel access specialised on the stored pixel size: Bytes 1..4, 0 for
+    // 1 bit pixels (MSB first). get and put read and write pixel x of a row
+    // (row_of) in the surface format; byte_lanes tells whether r, g, b are
+    // whole bytes of that value, so paints can work on it without mapping.
+    template <int Bytes> struct pixel_access;
+
+    struct linear_rows
+    {
+        typedef Uint8* row;
+        static row row_of(SDL_Surface* s, int y) { return pixel_row(s, y); }
+    };
+
+    template <> struct pixel_access<4> : linear_rows
+    {
+        static const bool byte_lanes = true;
+        static Uint32 get(const Uint8* row, int x) { return reinterpret_cast<const Uint32*>(row)[x]; }
+        static void put(Uint8* row, int x, Uint32 v) { reinterpret_cast<Uint32*>(row)[x] = v; }
+    };
+
+    template <> struct pixel_access<3> : linear_rows
+    {
+        static const bool byte_lanes = true;
+        static Uint32 get(const Uint8* row, int x)
         {
-            return mysym;
+            const Uint8* p = row + 3*x;
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+            return p[0] << 16 | p[1] << 8 | p[2];
+#else
+            return p[0] | p[1] << 8 | p[2] << 16;
+#endif
         }
-        else
+        static void put(Uint8* row, int x, Uint32 v)
         {
-            return sym;
+            Uint8* p = row + 3*x;
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+            p[0] = static_cast<Uint8>(v >> 16); p[1] = static_cast<Uint8>(v >> 8); p[2] = static_cast<Uint8>(v);
+#else
+            p[0] = static_cast<Uint8>(v); p[1] = static_cast<Uint8>(v >> 8); p[2] = static_cast<Uint8>(v >> 16);
+#endif
+        }
+    };
+
+    template <> struct pixel_access<2> : linear_rows
+    {
+        static const bool byte_lanes = false;
+        static Uint32 get(const Uint8* row, int x) { return reinterpret_cast<const Uint16*>(row)[x]; }
+        static void put(Uint8* row, int x, Uint32 v) { reinterpret_cast<Uint16*>(row)[x] = static_cast<Uint16>(v); }
+    };
+
+    template <> struct pixel_access<1> : linear_rows
+    {
+        static const bool byte_lanes = false;
+        static Uint32 get(const Uint8* row, int x) { return row[x]; }
+        static void put(Uint8* row, int x, Uint32 v) { row[x] = static_cast<Uint8>(v); }
+    };
+
+    template <> struct pixel_access<0> : linear_rows
+    {
+        static const bool byte_lanes = false;
+        static Uint32 get(const Uint8* row, int x) { return (row[x >> 3] >> (7 - (x & 7))) & 1; }
+        static void put(Uint8* row, int x, Uint32 v)
+        {
+            Uint8& b = row[x >> 3];
+            b = static_cast<Uint8>(v ? b | 0x80 >> (x & 7) : b & ~(0x80 >> (x & 7)));
+        }
+    };
+
+    // Pixels of a tiled_canvas, 32 bit: every band of 8 rows holds its 8x8
+    // tiles one after the other from its first row on, each tile row by row
+    // (32 bytes); the tiles of the last band have as many rows as it has.
+    // The pitch takes the width rounded up to 8 pixels, as create_surface().
+    struct tiled_row
+    {
+        Uint8* p;       // its row in the first tile
+        int tile;       // bytes of a tile of the band
+    };
+
+    struct tiled_access
+    {
+        static const bool byte_lanes = true;
+        typedef tiled_row row;
+        static row row_of(SDL_Surface* s, int y)
+        {
+            int band = y & ~7;
+            row r = { pixel_row(s, band) + (y & 7) * 32, std::min(8, s->h - band) * 32 };
+            return r;
         }
+        static Uint32* at(const row& r, int x) { return reinterpret_cast<Uint32*>(r.p + (x >> 3) * r.tile) + (x & 7); }
+        static Uint32 get(const row& r, int x) { return *at(r, x); }
+        static void put(const row& r, int x, Uint32 v) { *at(r, x) = v; }
+    };
+
+    inline Uint32* tiled_pixel(SDL_Surface* s, int x, int y)
+    {
+        return tiled_access::at(tiled_access::row_of(s, y), x);
     }
 
-    Uint32 timer_event(Uint32 interval, void*)
+    // n pixels of row y from x on, out of and into the tiles
+    void tiled_read(SDL_Surface* s, int x, int y, int n, Uint8* dst)
     {
-        SDL_Event ev;
-        ev.type = SDL_USEREVENT;
-        ev.user.code = SDL_GetTicks();
-        ev.user.data1 = 0;
-        ev.user.data2 = 0;
-        SDL_PushEvent(&ev);
+        tiled_row r = tiled_access::row_of(s, y);
+        for (int k; n > 0; x += k, n -= k, dst += 4*k)
+        {
+            k = std::min(n, 8 - (x & 7));
+            std::memcpy(dst, tiled_access::at(r, x), 4*k);
+        }
+    }
 
-        return interval;
+    void tiled_write(SDL_Surface* s, int x, int y, int n, const Uint8* src)
+    {
+        tiled_row r = tiled_access::row_of(s, y);
+        for (int k; n > 0; x += k, n -= k, src += 4*k)
+        {
+            k = std::min(n, 8 - (x & 7));
+            std::memcpy(tiled_access::at(r, x), src, 4*k);
+        }
     }
-}
 
-genv::canvas::canvas() {
-    buf=0;
-    font=0;
-    transp=0;
-    set_color(255,255,255);
-}
+    // Lays the rows of s out in tiles, or the tiles back in rows, in place:
+    // one band at a time through a copy of it.
+    void retile(SDL_Surface* s, bool to_tiles)
+    {
+        std::vector<Uint8> band(static_cast<std::size_t>(s->pitch) * 8);
+        for (int y0 = 0; y0 < s->h; y0 += 8)
+        {
+            int rows = std::min(8, s->h - y0);
+            Uint8* p = pixel_row(s, y0);
+            std::memcpy(&band[0], p, static_cast<std::size_t>(s->pitch) * rows);
+            for (int y = 0; y < rows; ++y)
+                for (int x = 0; x < s->w; x += 8)
+                {
+                    std::size_t lin = y * s->pitch + x * 4, til = (x >> 3) * rows * 32 + y * 32;
+                    std::size_t len = std::min(8, s->w - x) * 4;
+                    if (to_tiles)
+                        std::memcpy(p + til, &band[lin], len);
+                    else
+                        std::memcpy(p + lin, &band[til], len);
+                }
+        }
+    }
 
-genv::canvas& genv::canvas::operator=(const genv::canvas& c) {
-    pt_x=c.pt_x;
-    pt_y=c.pt_y;
-    draw_clr = c.draw_clr;
-    transp = c.transp;
-    antialiastext = c.antialiastext;
-	buf=0;
+    // Calls job(pixel_access<N>()) for the pixel size of s, or
+    // job(tiled_access()), so a primitive picks its access once and runs its
+    // loop on that.
+    template <typename Job>
+    void with_pixel_access(const SDL_Surface* s, Job& job, bool tiled = false)
+    {
+        if (tiled) {
+            job(tiled_access());
+            return;
+        }
+        if (s->format->BitsPerPixel == 1) {
+            job(pixel_access<0>());
+            return;
+        }
+        switch (s->format->BytesPerPixel)
+        {
+            case 1: job(pixel_access<1>()); break;
+            case 2: job(pixel_access<2>()); break;
+            case 3: job(pixel_access<3>()); break;
+            default: job(pixel_access<4>());
+        }
+    }
 
-    if (c.buf) {
-        buf = SDL_CreateRGBSurface(0, c.buf->w, c.buf->h, 32,0,0,0,0);
-        SDL_Rect trg;
-        trg.x = 0;
-        trg.y = 0;
-        SDL_BlitSurface( c.buf, NULL, buf, &trg);
+    // 32 bit surfaces only, for the paths that checked the format before
+    inline Uint32& pixel(SDL_Surface* screen, int x, int y)
+    {
+        return reinterpret_cast<Uint32*>(pixel_row(screen, y))[x];
+    }
+
+    // any pixel size, for the generic paths going pixel by pixel
+    inline Uint32 read_pixel(const SDL_Surface* s, int x, int y)
+    {
+        const Uint8* row = pixel_row(s, y);
+        if (s->format->BitsPerPixel == 1)
+            return pixel_access<0>::get(row, x);
+        switch (s->format->BytesPerPixel)
+        {
+            case 1: return pixel_access<1>::get(row, x);
+            case 2: return pixel_access<2>::get(row, x);
+            case 3: return pixel_access<3>::get(row, x);
+            default: return pixel_access<4>::get(row, x);
+        }
     }
 
-    font=0;
+    inline void write_pixel(SDL_Surface* s, int x, int y, Uint32 v)
+    {
+        Uint8* row = pixel_row(s, y);
+        if (s->format->BitsPerPixel == 1)
+            pixel_access<0>::put(row, x, v);
+        else switch (s->format->BytesPerPixel)
+        {
+            case 1: pixel_access<1>::put(row, x, v); break;
+            case 2: pixel_access<2>::put(row, x, v); break;
+            case 3: pixel_access<3>::put(row, x, v); break;
+            default: pixel_access<4>::put(row, x, v);
+        }
+    }
 
-    if (c.font) {
-        load_font(c.loaded_font_file_name, c.font_size);
+    // SDL_FillRects, also for 1 bit surfaces, which SDL cannot fill, and
+    // for tiles
+    void fill_rects(SDL_Surface* s, const SDL_Rect* r, int n, Uint32 clr, bool tiled = false)
+    {
+        if (tiled) {
+            for (int i = 0; i < n; ++i)
+                for (int y = r[i].y; y < r[i].y + r[i].h; ++y)
+                {
+                    tiled_row t = tiled_access::row_of(s, y);
+                    for (int x = r[i].x, k, end = r[i].x + r[i].w; x < end; x += k)
+                    {
+                        k = std::min(end - x, 8 - (x & 7));
+                        std::fill_n(tiled_access::at(t, x), k, clr);
+                    }
+                }
+            return;
+        }
+        if (s->format->BitsPerPixel >= 8) {
+            SDL_FillRects(s, r, n, clr);
+            return;
+        }
+        for (int i = 0; i < n; ++i)
+            for (int y = r[i].y; y < r[i].y + r[i].h; ++y)
+                set_bits(static_cast<Uint8*>(s->pixels) + y * s->pitch, r[i].x, r[i].w, clr != 0);
     }
-	return *this;
 
-}
+    struct dot_job
+    {
+        SDL_Surface* s;
+        int x, y;
+        Uint32 clr;
 
-genv::canvas::canvas(const genv::canvas & c) {
-    //az esetek nagy részében nem jó ötlet másoló konstruktorban értékadást használni, mert érdemes kihasználni, hogy a : operátorral örökíthetőek a mező konstruktorok. Ez a kód refaktorálásra szorulhat a jövőben, ha sok mező konstruktor-lefutása megspórolható lehet, jelenleg nincs ilyen mező, ezért használhatunk értékadást érdemi lassulás nélkül
-	*this = c;
-}
+        template <typename P>
+        void operator () (P) const
+        { P::put(P::row_of(s, y), x, clr); }
+    };
 
-genv::canvas::canvas(int w, int h) {
-    buf=0;
-    font=0;
-    loaded_font_file_name="";
-    transp=0;
-    set_color(255,255,255);
-    open(w,h);
+    // Bresenham steps of canvas::draw_line from x, y while they stay on the
+    // surface, leaving x, y at the last pixel set. org_x, org_y: the origin
+    // of ring canvases, added modulo the size when addressing.
+    struct line_job
+    {
+        SDL_Surface* s;
+        int org_x, org_y;
+        int x, y;
+        int xstep, ystep, xshift, yshift, steps, shifts;
+        Uint32 clr;
+
+        template <typename P>
+        void operator () (P)
+        {
+            const int w = s->w, h = s->h;
+            int px = x + org_x, py = y + org_y;
+            if (px >= w) px -= w;
+            if (py >= h) py -= h;
+            P::put(P::row_of(s, py), px, clr);
+            int len = 0;
+            for (int i=0; i<steps; ++i)
+            {
+                int dx = xstep, dy = ystep;
+                if ((len += shifts) >= steps)
+                {
+                    dx += xshift;
+                    dy += yshift;
+                    len -= steps;
+                }
+                int nx = x + dx, ny = y + dy;
+                if (nx < 0 || ny < 0 || nx >= w || ny >= h)
+                    return;
+                x = nx;
+                y = ny;
+                px += dx;
+                py += dy;
+                if (px >= w) px -= w; else if (px < 0) px += w;
+                if (py >= h) py -= h; else if (py < 0) py += h;
+                P::put(P::row_of(s, py), px, clr);
+            }
+        }
+    };
+
+    void copy_palette(const SDL_Surface* from, SDL_Surface* to)
+    {
+        const SDL_Palette* p = from->format->palette;
+        if (p && to && to->format->palette)
+            SDL_SetPaletteColors(to->format->palette, p->colors, 0, std::min(p->ncolors, to->format->palette->ncolors));
+    }
+
+    // a surface for a copy of (a part of) s: its format and palette
+    void set_palette_colors(SDL_Surface* s, const std::vector<unsigned>& rgb)
+    {
+        if (s->format->palette == 0 || rgb.empty())
+            return;
+        SDL_Color colors[256];
+        int n = std::min(static_cast<int>(rgb.size()), std::min(s->format->palette->ncolors, 256));
+        for (int i = 0; i < n; ++i)
+        {
+            SDL_Color c = { static_cast<Uint8>(rgb[i] >> 16), static_cast<Uint8>(rgb[i] >> 8), static_cast<Uint8>(rgb[i]), 0xff };
+            colors[i] = c;
+        }
+        SDL_SetPaletteColors(s->format->palette, colors, 0, n);
+    }
+
+    SDL_Surface* create_like(const SDL_Surface* s, int w, int h)
+    {
+        SDL_Surface* c = create_surface(w, h, s->format->format);
+        copy_palette(s, c);
+        return c;
+    }
+
+    // s (32 bit, in rows) laid out in tiles; copied first when its pitch
+    // has no room for the last tile of a row, s is freed then
+    SDL_Surface* in_tiles(SDL_Surface* s)
+    {
+        if (s->pitch < ((s->w + 7) & ~7) * 4) {
+            SDL_Surface* c = create_like(s, s->w, s->h);
+            for (int y = 0; c && y < s->h; ++y)
+                std::memcpy(pixel_row(c, y), pixel_row(s, y), s->w * 4);
+            free_surface(s);
+            if (c == 0)
+                return 0;
+            s = c;
+        }
+        retile(s, true);
+        return s;
+    }
+
+    Uint32 compact_sdl_format(int f)
+    {
+        switch (f)
+        {
+            case genv::compact_rgb565: return SDL_PIXELFORMAT_RGB565;
+            case genv::compact_mask1: return SDL_PIXELFORMAT_INDEX1MSB;
+            default: return SDL_PIXELFORMAT_INDEX8;
+        }
+    }
+
+    // 0xRRGGBB colors to the stored values of a compact canvas: the top
+    // bits for RGB565, the mean for gray, the nearest palette entry
+    // (remembering the last one) and non-black for a mask. SDL_MapRGB gives
+    // the same, blits into 8 bits go through 3-3-2 colors instead.
+    class compact_mapper
+    {
+    public:
+        compact_mapper(int kind, const std::vector<unsigned>& pal) : kind(kind), pal(pal), last_rgb(~0u), last(0) {}
+        Uint32 operator () (Uint32 rgb)
+        {
+            rgb &= 0xffffff;
+            int r = rgb >> 16, g = (rgb >> 8) & 0xff, b = rgb & 0xff;
+            switch (kind)
+            {
+                case genv::compact_rgb565: return (r >> 3) << 11 | (g >> 2) << 5 | b >> 3;
+                case genv::compact_gray8: return (r + g + b + 1) / 3;
+                case genv::compact_mask1: return rgb != 0;
+                default: break;
+            }
+            if (rgb == last_rgb)
+                return last;
+            int best = 1 << 30;
+            for (std::size_t i = 0; i < pal.size(); ++i)
+            {
+                int dr = static_cast<int>(pal[i] >> 16) - r, dg = static_cast<int>((pal[i] >> 8) & 0xff) - g;
+                int db = static_cast<int>(pal[i] & 0xff) - b;
+                int d = dr*dr + dg*dg + db*db;
+                if (d < best) {
+                    best = d;
+                    last = static_cast<Uint32>(i);
+                }
+            }
+            last_rgb = rgb;
+            return last;
+        }
+
+    private:
+        int kind;
+        const std::vector<unsigned>& pal;
+        Uint32 last_rgb, last;
+    };
+
+    // The same few operations on the byte lanes of 4 (SSE2) or 8 (AVX2)
+    // pixels, widened to 16 bits, for writing the blend kernels once.
+#if GENV_AVX2
+#define GENV_SIMD 1
+    typedef __m256i vec;
+    const int vec_px = 8;
+    inline vec v_load(const Uint32* p) { return _mm256_loadu_si256(reinterpret_cast<const vec*>(p)); }
+    inline void v_store(Uint32* p, vec v) { _mm256_storeu_si256(reinterpret_cast<vec*>(p), v); }
+    inline vec v_set32(Uint32 x) { return _mm256_set1_epi32(static_cast<int>(x)); }
+    inline vec v_set16(short x) { return _mm256_set1_epi16(x); }
+    inline vec v_and(vec a, vec b) { return _mm256_and_si256(a, b); }
+    inline vec v_or(vec a, vec b) { return _mm256_or_si256(a, b); }
+    inline vec v_andnot(vec a, vec b) { return _mm256_andnot_si256(a, b); }
+    inline vec v_eq32(vec a, vec b) { return _mm256_cmpeq_epi32(a, b); }
+    inline bool v_all(vec m) { return _mm256_movemask_epi8(m) == -1; }
+    inline bool v_none(vec v) { return _mm256_testz_si256(v, v) != 0; }
+    inline vec v_lo(vec v) { return _mm256_unpacklo_epi8(v, _mm256_setzero_si256()); }
+    inline vec v_hi(vec v) { return _mm256_unpackhi_epi8(v, _mm256_setzero_si256()); }
+    inline vec v_pack(vec lo, vec hi) { return _mm256_packus_epi16(lo, hi); }
+    inline vec v_add(vec a, vec b) { return _mm256_add_epi16(a, b); }
+    inline vec v_sub(vec a, vec b) { return _mm256_sub_epi16(a, b); }
+    inline vec v_mul(vec a, vec b) { return _mm256_mullo_epi16(a, b); }
+    inline vec v_min(vec a, vec b) { return _mm256_min_epi16(a, b); }
+    inline vec v_max(vec a, vec b) { return _mm256_max_epi16(a, b); }
+    inline vec v_shr8(vec v) { return _mm256_srli_epi16(v, 8); }
+    inline vec v_alpha(vec v) { return _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(v, 0xff), 0xff); }
+#elif GENV_SSE2
+#define GENV_SIMD 1
+    typedef __m128i vec;
+    const int vec_px = 4;
+    inline vec v_load(const Uint32* p) { return _mm_loadu_si128(reinterpret_cast<const vec*>(p)); }
+    inline void v_store(Uint32* p, vec v) { _mm_storeu_si128(reinterpret_cast<vec*>(p), v); }
+    inline vec v_set32(Uint32 x) { return _mm_set1_epi32(static_cast<int>(x)); }
+    inline vec v_set16(short x) { return _mm_set1_epi16(x); }
+    inline vec v_and(vec a, vec b) { return _mm_and_si128(a, b); }
+    inline vec v_or(vec a, vec b) { return _mm_or_si128(a, b); }
+    inline vec v_andnot(vec a, vec b) { return _mm_andnot_si128(a, b); }
+    inline vec v_eq32(vec a, vec b) { return _mm_cmpeq_epi32(a, b); }
+    inline bool v_all(vec m) { return _mm_movemask_epi8(m) == 0xffff; }
+    inline bool v_none(vec v) { return _mm_movemask_epi8(_mm_cmpeq_epi32(v, _mm_setzero_si128())) == 0xffff; }
+    inline vec v_lo(vec v) { return _mm_unpacklo_epi8(v, _mm_setzero_si128()); }
+    inline vec v_hi(vec v) { return _mm_unpackhi_epi8(v, _mm_setzero_si128()); }
+    inline vec v_pack(vec lo, vec hi) { return _mm_packus_epi16(lo, hi); }
+    inline vec v_add(vec a, vec b) { return _mm_add_epi16(a, b); }
+    inline vec v_sub(vec a, vec b) { return _mm_sub_epi16(a, b); }
+    inline vec v_mul(vec a, vec b) { return _mm_mullo_epi16(a, b); }
+    inline vec v_min(vec a, vec b) { return _mm_min_epi16(a, b); }
+    inline vec v_max(vec a, vec b) { return _mm_max_epi16(a, b); }
+    inline vec v_shr8(vec v) { return _mm_srli_epi16(v, 8); }
+    inline vec v_alpha(vec v) { return _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xff), 0xff); }
+#endif
+
+    // x / 255 rounded, for x up to 255*255
+    inline int div255(int x) { x += 128; return (x + (x >> 8)) >> 8; }
+#if GENV_SIMD
+    inline vec v_div255(vec x) { x = v_add(x, v_set16(128)); return v_shr8(v_add(x, v_shr8(x))); }
+#endif
+
+    // Blend modes on one byte lane: s source, d target, na = 255 - source
+    // alpha, t tint. Sources are premultiplied, results clamped to 255 later.
+    struct over_op
+    {
+        static const bool opaque_copies = true;
+        static int apply(int s, int d, int na, int) { return s + div255(d*na); }
+#if GENV_SIMD
+        static vec apply(vec s, vec d, vec na, vec) { return v_add(s, v_div255(v_mul(d, na))); }
+#endif
+    };
+
+    struct add_op
+    {
+        static const bool opaque_copies = false;
+        static int apply(int s, int d, int, int) { return s + d; }
+#if GENV_SIMD
+        static vec apply(vec s, vec d, vec, vec) { return v_add(s, d); }
+#endif
+    };
+
+    struct multiply_op
+    {
+        static const bool opaque_copies = false;
+        static int apply(int s, int d, int na, int) { return div255(d*(s + na)); }
+#if GENV_SIMD
+        static vec apply(vec s, vec d, vec na, vec) { return v_div255(v_mul(d, v_add(s, na))); }
+#endif
+    };
+
+    struct screen_op
+    {
+        static const bool opaque_copies = false;
+        static int apply(int s, int d, int, int) { return s + div255(d*(255 - s)); }
+#if GENV_SIMD
+        static vec apply(vec s, vec d, vec, vec) { return v_add(s, v_div255(v_mul(d, v_sub(v_set16(255), s)))); }
+#endif
+    };
+
+    struct min_op
+    {
+        static const bool opaque_copies = false;
+        static int apply(int s, int d, int na, int) { return std::min(d, s + div255(d*na)); }
+#if GENV_SIMD
+        static vec apply(vec s, vec d, vec na, vec) { return v_min(d, v_add(s, v_div255(v_mul(d, na)))); }
+#endif
+    };
+
+    struct max_op
+    {
+        static const bool opaque_copies = false;
+        static int apply(int s, int d, int na, int) { return std::max(d, s + div255(d*na)); }
+#if GENV_SIMD
+        static vec apply(vec s, vec d, vec na, vec) { return v_max(d, v_add(s, v_div255(v_mul(d, na)))); }
+#endif
+    };
+
+    struct tint_op    // the source times the tint, over the target
+    {
+        static const bool opaque_copies = false;
+        static int apply(int s, int d, int na, int t) { return div255(s*t) + div255(d*na); }
+#if GENV_SIMD
+        static vec apply(vec s, vec d, vec na, vec t) { return v_add(v_div255(v_mul(s, t)), v_div255(v_mul(d, na))); }
+#endif
+    };
+
+    // where the source alpha comes from: the top byte, none (opaque), or
+    // the black color key
+    enum source_kind { alpha_source, opaque_source, keyed_source };
+
+    inline Uint32 source_pixel(Uint32 s, int kind)
+    {
+        if (kind == alpha_source)
+            return s;
+        s &= 0x00ffffff;
+        return kind == keyed_source && s == 0 ? 0 : s | 0xff000000;
+    }
+
+    // One row of a blend mode, 32 bit pixels with the alpha (or a spare
+    // byte) on top. Fully transparent source blocks are skipped, fully
+    // opaque ones copied where the mode allows.
+    template <typename Op>
+    void blend_row(Uint32* dst, const Uint32* src, int n, int kind, Uint32 tint)
+    {
+        int i = 0;
+#if GENV_SIMD
+        const vec amask = v_set32(0xff000000), zero = v_set32(0), t = v_lo(v_set32(tint));
+        const vec full = v_set16(255);
+        for (; i + vec_px <= n; i += vec_px)
+        {
+            vec s = v_load(src + i);
+            if (kind == opaque_source) {
+                s = v_or(s, amask);
+            } else if (kind == keyed_source) {
+                vec rgb = v_andnot(amask, s);
+                s = v_andnot(v_eq32(rgb, zero), v_or(rgb, amask));
+            }
+            if (v_none(s))
+                continue;
+            if (Op::opaque_copies && v_all(v_eq32(v_and(s, amask), amask))) {
+                v_store(dst + i, s);
+                continue;
+            }
+            vec d = v_load(dst + i);
+            vec slo = v_lo(s), shi = v_hi(s);
+            vec lo = Op::apply(slo, v_lo(d), v_sub(full, v_alpha(slo)), t);
+            vec hi = Op::apply(shi, v_hi(d), v_sub(full, v_alpha(shi)), t);
+            v_store(dst + i, v_pack(lo, hi));
+        }
+#endif
+        for (; i < n; ++i)
+        {
+            Uint32 s = source_pixel(src[i], kind);
+            if (s == 0)
+                continue;
+            if (Op::opaque_copies && (s >> 24) == 255) {
+                dst[i] = s;
+                continue;
+            }
+            int na = 255 - static_cast<int>(s >> 24);
+            Uint32 d = dst[i], r = 0;
+            for (int c = 0; c < 32; c += 8)
+                r |= static_cast<Uint32>(std::min(255, Op::apply((s >> c) & 0xff, (d >> c) & 0xff, na, (tint >> c) & 0xff))) << c;
+            dst[i] = r;
+        }
+    }
+
+    typedef void (*blend_row_fn)(Uint32* dst, const Uint32* src, int n, int kind, Uint32 tint);
+
+    blend_row_fn blend_kernel(genv::blend_mode mode)
+    {
+        switch (mode)
+        {
+            case genv::blend_add: return blend_row<add_op>;
+            case genv::blend_multiply: return blend_row<multiply_op>;
+            case genv::blend_screen: return blend_row<screen_op>;
+            case genv::blend_min: return blend_row<min_op>;
+            case genv::blend_max: return blend_row<max_op>;
+            case genv::blend_tint: return blend_row<tint_op>;
+            default: return blend_row<over_op>;
+        }
+    }
+
+    // blend over n pixels of row y of a tiled surface from x on
+    void blend_tiled(blend_row_fn blend, SDL_Surface* s, int x, int y, const Uint32* src, int n, int kind, Uint32 tint)
+    {
+        tiled_row r = tiled_access::row_of(s, y);
+        for (int k; n > 0; x += k, n -= k, src += k)
+        {
+            k = std::min(n, 8 - (x & 7));
+            blend(tiled_access::at(r, x), src, k, kind, tint);
+        }
+    }
+
+    // Source of the transformed blits: 32 bit pixels, pitch in pixels; or
+    // the tiles of a tiled_canvas from x0, y0 on, for nearest samples.
+    struct texels
+    {
+        const Uint32* px;
+        int pitch, w, h;
+        SDL_Surface* tiles;
+        int x0, y0;
+        Uint32 at(int x, int y) const   // clamped to the edges
+        {
+            x = std::min(std::max(x, 0), w - 1);
+            y = std::min(std::max(y, 0), h - 1);
+            return px[static_cast<std::ptrdiff_t>(y) * pitch + x];
+        }
+    };
+
+    // a + (b - a) * f / 128 on every byte
+    inline Uint32 lerp_px(Uint32 a, Uint32 b, int f)
+    {
+        Uint32 rb = ((a & 0x00ff00ff) * (128 - f) + (b & 0x00ff00ff) * f) >> 7;
+        Uint32 ag = (((a >> 8) & 0x00ff00ff) * (128 - f) + ((b >> 8) & 0x00ff00ff) * f) << 1;
+        return (rb & 0x00ff00ff) | (ag & 0xff00ff00);
+    }
+
+    // n samples from u, v on, stepping du, dv; 16.16 fixed point in 64 bits
+    // (sources may be wider than 32767 pixels), all in the source rectangle
+    void sample_nearest(const texels& t, long long u, long long v, long long du, long long dv, Uint32* out, int n)
+    {
+        if (t.tiles) {
+            // tiled_access inlined: whole bands have tiles of 256 bytes
+            const Uint8* px = static_cast<const Uint8*>(t.tiles->pixels);
+            int pitch = t.tiles->pitch, full = t.tiles->h & ~7, last = (t.tiles->h & 7) * 32;
+            for (int i = 0; i < n; ++i, u += du, v += dv)
+            {
+                int x = t.x0 + static_cast<int>(u >> 16), y = t.y0 + static_cast<int>(v >> 16), band = y & ~7;
+                out[i] = *reinterpret_cast<const Uint32*>(px + static_cast<std::ptrdiff_t>(band) * pitch +
+                                                          static_cast<std::ptrdiff_t>(x >> 3) * (band < full ? 256 : last) +
+                                                          (y & 7) * 32 + (x & 7) * 4);
+            }
+            return;
+        }
+        for (int i = 0; i < n; ++i, u += du, v += dv)
+            out[i] = t.px[static_cast<std::ptrdiff_t>(v >> 16) * t.pitch + static_cast<std::ptrdiff_t>(u >> 16)];
+    }
+
+    // u, v relative to texel centers here, the 4 texels around are weighted
+    // with 7 bit fractions; the SSE2 path gives the same bits
+    void sample_bilinear(const texels& t, long long u, long long v, long long du, long long dv, Uint32* out, int n)
+    {
+#if GENV_SIMD
+        const __m128i zero = _mm_setzero_si128();
+#endif
+        for (int i = 0; i < n; ++i, u += du, v += dv)
+        {
+            int x = static_cast<int>(u >> 16), y = static_cast<int>(v >> 16);
+            int fx = static_cast<int>(u >> 9) & 0x7f, fy = static_cast<int>(v >> 9) & 0x7f;
+            if (x < 0 || y < 0 || x + 1 >= t.w || y + 1 >= t.h) {
+                out[i] = lerp_px(lerp_px(t.at(x, y), t.at(x + 1, y), fx),
+                                 lerp_px(t.at(x, y + 1), t.at(x + 1, y + 1), fx), fy);
+                continue;
+            }
+            const Uint32* p = t.px + static_cast<std::ptrdiff_t>(y) * t.pitch + x;
+#if GENV_SIMD
+            __m128i q = _mm_unpacklo_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)),
+                                           _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p + t.pitch)));
+            // left and right texels of both rows, then the two rows
+            __m128i hz = _mm_srli_epi16(_mm_add_epi16(
+                            _mm_mullo_epi16(_mm_unpacklo_epi8(q, zero), _mm_set1_epi16(static_cast<short>(128 - fx))),
+                            _mm_mullo_epi16(_mm_unpackhi_epi8(q, zero), _mm_set1_epi16(static_cast<short>(fx)))), 7);
+            __m128i vt = _mm_mullo_epi16(hz, _mm_set_epi16(static_cast<short>(fy), static_cast<short>(fy), static_cast<short>(fy), static_cast<short>(fy),
+                                                           static_cast<short>(128 - fy), static_cast<short>(128 - fy), static_cast<short>(128 - fy), static_cast<short>(128 - fy)));
+            vt = _mm_srli_epi16(_mm_add_epi16(vt, _mm_srli_si128(vt, 8)), 7);
+            out[i] = static_cast<Uint32>(_mm_cvtsi128_si32(_mm_packus_epi16(vt, zero)));
+#else
+            out[i] = lerp_px(lerp_px(p[0], p[1], fx), lerp_px(p[t.pitch], p[t.pitch + 1], fx), fy);
+#endif
+        }
+    }
+
+    // Bounding box of a w x h rectangle scaled, turned by angle degrees
+    // around the pivot and moved to tx, ty; clipped to a bw x bh target.
+    bool transformed_box(int w, int h, double tx, double ty, double scale_x, double scale_y, double angle,
+                         double pivot_x, double pivot_y, int bw, int bh, int& x0, int& y0, int& x1, int& y1)
+    {
+        double a = angle * 3.14159265358979323846 / 180;
+        double cs = std::cos(a), sn = std::sin(a);
+        double bx0 = 1e30, by0 = 1e30, bx1 = -1e30, by1 = -1e30;
+        for (int i = 0; i < 4; ++i)
+        {
+            double u = (i & 1 ? w : 0) - pivot_x, v = (i & 2 ? h : 0) - pivot_y;
+            double x = tx + cs * u * scale_x - sn * v * scale_y, y = ty + sn * u * scale_x + cs * v * scale_y;
+            bx0 = std::min(bx0, x); bx1 = std::max(bx1, x);
+            by0 = std::min(by0, y); by1 = std::max(by1, y);
+        }
+        x0 = static_cast<int>(std::max(std::floor(bx0), 0.0));
+        x1 = static_cast<int>(std::min(std::ceil(bx1), double(bw)));
+        y0 = static_cast<int>(std::max(std::floor(by0), 0.0));
+        y1 = static_cast<int>(std::min(std::ceil(by1), double(bh)));
+        return x0 < x1 && y0 < y1;
+    }
+
+    // 2x2 box filter of a w*h image into (w+1)/2 * (h+1)/2, odd edges repeated
+    void halve(const Uint32* src, int w, int h, Uint32* dst)
+    {
+        int dw = (w + 1) / 2, dh = (h + 1) / 2;
+        for (int y = 0; y < dh; ++y)
+        {
+            const Uint32* r0 = src + 2 * y * w;
+            const Uint32* r1 = 2 * y + 1 < h ? r0 + w : r0;
+            Uint32* out = dst + y * dw;
+            int x = 0;
+#if GENV_SIMD
+            const __m128i zero = _mm_setzero_si128(), two = _mm_set1_epi16(2);
+            for (; 2 * x + 8 <= w; x += 4)
+            {
+                __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(r0 + 2 * x));
+                __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(r1 + 2 * x));
+                __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(r0 + 2 * x + 4));
+                __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(r1 + 2 * x + 4));
+                // column sums of pixel pairs, then the pairs
+                __m128i s0 = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+                __m128i s1 = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+                __m128i s2 = _mm_add_epi16(_mm_unpacklo_epi8(c, zero), _mm_unpacklo_epi8(d, zero));
+                __m128i s3 = _mm_add_epi16(_mm_unpackhi_epi8(c, zero), _mm_unpackhi_epi8(d, zero));
+                s0 = _mm_add_epi16(s0, _mm_srli_si128(s0, 8));
+                s1 = _mm_add_epi16(s1, _mm_srli_si128(s1, 8));
+                s2 = _mm_add_epi16(s2, _mm_srli_si128(s2, 8));
+                s3 = _mm_add_epi16(s3, _mm_srli_si128(s3, 8));
+                __m128i lo = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(s0, s1), two), 2);
+                __m128i hi = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(s2, s3), two), 2);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x), _mm_packus_epi16(lo, hi));
+            }
+#endif
+            for (; x < dw; ++x)
+            {
+                int x0 = 2 * x, x1 = std::min(2 * x + 1, w - 1);
+                Uint32 o = 0;
+                for (int c = 0; c < 32; c += 8)
+                    o |= (((r0[x0] >> c & 0xff) + (r0[x1] >> c & 0xff) + (r1[x0] >> c & 0xff) + (r1[x1] >> c & 0xff) + 2) >> 2) << c;
+                out[x] = o;
+            }
+        }
+    }
+
+    // each of n pixels repeated s times, for the scaled window
+    void enlarge_row(const Uint32* src, int n, int s, Uint32* dst)
+    {
+        int i = 0;
+#if GENV_SIMD
+        if (s == 2) {
+            for (; i + 4 <= n; i += 4, dst += 8)
+            {
+                __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_unpacklo_epi32(v, v));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 4), _mm_unpackhi_epi32(v, v));
+            }
+        } else if (s == 3) {
+            for (; i + 4 <= n; i += 4, dst += 12)
+            {
+                __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 0, 0)));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 4), _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 2, 1, 1)));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 8), _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 2)));
+            }
+        } else if (s >= 4) {
+            // stores of 4 from the start, the last one ending at s
+            for (; i < n; ++i, dst += s)
+            {
+                __m128i v = _mm_set1_epi32(static_cast<int>(src[i]));
+                for (int k = 0; k + 4 < s; k += 4)
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + k), v);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + s - 4), v);
+            }
+        }
+#endif
+        for (; i < n; ++i, dst += s)
+            for (int k = 0; k < s; ++k)
+                dst[k] = src[i];
+    }
+
+    // Turns the stored values of a compact canvas into 32 bit pixels of a
+    // target with byte lanes: through a table for the palette formats, with
+    // the lane shifts of the target for RGB565 (bits repeated like SDL does).
+    struct expander
+    {
+        int bits;           // per stored pixel: 1, 8 or 16
+        bool gray;          // v * 0x010101
+        int rshift, gshift, bshift;
+        Uint32 amask;       // set in every pixel
+        Uint32 lut[256];
+    };
+
+    void make_expander(expander& e, const SDL_Surface* s, int kind, const SDL_PixelFormat* df)
+    {
+        e.bits = s->format->BitsPerPixel;
+        e.gray = kind == genv::compact_gray8;
+        e.rshift = df->Rshift;
+        e.gshift = df->Gshift;
+        e.bshift = df->Bshift;
+        e.amask = df->Amask;
+        std::fill(e.lut, e.lut + 256, e.amask);
+        const SDL_Palette* p = s->format->palette;
+        for (int i = 0; p && i < p->ncolors && i < 256; ++i)
+            e.lut[i] = static_cast<Uint32>(p->colors[i].r) << e.rshift | static_cast<Uint32>(p->colors[i].g) << e.gshift |
+                       static_cast<Uint32>(p->colors[i].b) << e.bshift | e.amask;
+    }
+
+    // n pixels from x on of a stored row
+    void expand_row(const expander& e, const Uint8* row, int x, int n, Uint32* dst)
+    {
+        int i = 0;
+        if (e.bits == 16) {
+            const Uint16* p = reinterpret_cast<const Uint16*>(row) + x;
+#if GENV_SIMD
+            const __m128i zero = _mm_setzero_si128(), m5 = _mm_set1_epi32(31), m6 = _mm_set1_epi32(63);
+            const __m128i a = _mm_set1_epi32(static_cast<int>(e.amask));
+            const __m128i rs = _mm_cvtsi32_si128(e.rshift), gs = _mm_cvtsi32_si128(e.gshift), bs = _mm_cvtsi32_si128(e.bshift);
+            for (; i + 8 <= n; i += 8)
+            {
+                __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+                for (int k = 0; k < 2; ++k)
+                {
+                    __m128i q = k ? _mm_unpackhi_epi16(v, zero) : _mm_unpacklo_epi16(v, zero);
+                    __m128i r = _mm_and_si128(_mm_srli_epi32(q, 11), m5);
+                    __m128i g = _mm_and_si128(_mm_srli_epi32(q, 5), m6);
+                    __m128i b = _mm_and_si128(q, m5);
+                    r = _mm_or_si128(_mm_slli_epi32(r, 3), _mm_srli_epi32(r, 2));
+                    g = _mm_or_si128(_mm_slli_epi32(g, 2), _mm_srli_epi32(g, 4));
+                    b = _mm_or_si128(_mm_slli_epi32(b, 3), _mm_srli_epi32(b, 2));
+                    __m128i o = _mm_or_si128(_mm_or_si128(_mm_sll_epi32(r, rs), _mm_sll_epi32(g, gs)),
+                                             _mm_or_si128(_mm_sll_epi32(b, bs), a));
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + 4 * k), o);
+                }
+            }
+#endif
+            for (; i < n; ++i)
+            {
+                Uint32 v = p[i], r = v >> 11, g = (v >> 5) & 63, b = v & 31;
+                dst[i] = (r << 3 | r >> 2) << e.rshift | (g << 2 | g >> 4) << e.gshift | (b << 3 | b >> 2) << e.bshift | e.amask;
+            }
+        } else if (e.bits == 8) {
+            const Uint8* p = row + x;
+#if GENV_SIMD
+            if (e.gray) {
+                // v v in 16 bits, then 0 v above them
+                const __m128i zero = _mm_setzero_si128(), a = _mm_set1_epi32(static_cast<int>(e.amask));
+                for (; i + 16 <= n; i += 16)
+                {
+                    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+                    __m128i vv = _mm_unpacklo_epi8(v, v), z = _mm_unpacklo_epi8(v, zero);
+                    __m128i* d = reinterpret_cast<__m128i*>(dst + i);
+                    _mm_storeu_si128(d, _mm_or_si128(_mm_unpacklo_epi16(vv, z), a));
+                    _mm_storeu_si128(d + 1, _mm_or_si128(_mm_unpackhi_epi16(vv, z), a));
+                    vv = _mm_unpackhi_epi8(v, v);
+                    z = _mm_unpackhi_epi8(v, zero);
+                    _mm_storeu_si128(d + 2, _mm_or_si128(_mm_unpacklo_epi16(vv, z), a));
+                    _mm_storeu_si128(d + 3, _mm_or_si128(_mm_unpackhi_epi16(vv, z), a));
+                }
+            }
+#endif
+#if GENV_AVX2
+            for (; i + 8 <= n; i += 8)
+            {
+                __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p + i)));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i),
+                                    _mm256_i32gather_epi32(reinterpret_cast<const int*>(e.lut), idx, 4));
+            }
+#endif
+            for (; i < n; ++i)
+                dst[i] = e.lut[p[i]];
+        } else {
+            // from a whole byte on, 8 pixels are selected by its bits
+            for (; i < n && ((x + i) & 7); ++i)
+                dst[i] = e.lut[(row[(x + i) >> 3] >> (7 - ((x + i) & 7))) & 1];
+#if GENV_SIMD
+            const __m128i hi = _mm_set_epi32(0x10, 0x20, 0x40, 0x80), lo = _mm_set_epi32(1, 2, 4, 8);
+            const __m128i on = _mm_set1_epi32(static_cast<int>(e.lut[1])), off = _mm_set1_epi32(static_cast<int>(e.lut[0]));
+            for (; i + 8 <= n; i += 8)
+            {
+                __m128i b = _mm_set1_epi32(row[(x + i) >> 3]);
+                __m128i m0 = _mm_cmpeq_epi32(_mm_and_si128(b, hi), hi), m1 = _mm_cmpeq_epi32(_mm_and_si128(b, lo), lo);
+                __m128i* d = reinterpret_cast<__m128i*>(dst + i);
+                _mm_storeu_si128(d, _mm_or_si128(_mm_and_si128(m0, on), _mm_andnot_si128(m0, off)));
+                _mm_storeu_si128(d + 1, _mm_or_si128(_mm_and_si128(m1, on), _mm_andnot_si128(m1, off)));
+            }
+#endif
+            for (; i < n; ++i)
+                dst[i] = e.lut[(row[(x + i) >> 3] >> (7 - ((x + i) & 7))) & 1];
+        }
+    }
+
+    inline long long floor_div(long long a, long long b)   // b > 0
+    {
+        return a >= 0 ? a / b : -((-a + b - 1) / b);
+    }
+
+    // the i in [first, last) for which 0 <= u + i*du < limit
+    void clip_steps(long long u, long long du, long long limit, int& first, int& last)
+    {
+        if (du == 0) {
+            if (u < 0 || u >= limit)
+                last = first;
+            return;
+        }
+        long long lo, hi;   // inclusive
+        if (du > 0) {
+            lo = -floor_div(u, du);
+            hi = floor_div(limit - 1 - u, du);
+        } else {
+            lo = -floor_div(limit - 1 - u, -du);
+            hi = floor_div(u, -du);
+        }
+        first = static_cast<int>(std::max<long long>(first, lo));
+        last = static_cast<int>(std::min<long long>(last, hi + 1));
+    }
+
+    // The color the glyph paints get: in the surface format where that has
+    // byte lanes (24 and 32 bit), 0xRRGGBB for the others, which are painted
+    // through that.
+    inline int glyph_color(SDL_Surface* screen, int rgb, bool alpha = false)
+    {
+        return screen->format->BytesPerPixel >= 3 ? static_cast<int>(map_rgb(screen, rgb, alpha)) : rgb & 0xffffff;
+    }
+
+    inline Uint32 read_rgb(const SDL_Surface* s, int x, int y)
+    {
+        Uint8 r, g, b;
+        SDL_GetRGB(read_pixel(s, x, y), s->format, &r, &g, &b);
+        return static_cast<Uint32>(r) << 16 | g << 8 | b;
+    }
+
+    // Glyph sources of the fixed cell blitter, both give 0..15 coverage.
+    struct nibble_glyph   // built-in font, 4 bits per pixel, LSB first
+    {
+        const unsigned* face;
+        int operator () (int row, int col) const
+        { return (face[row] >> 4*col) & 0xF; }
+    };
+
+    struct mono_glyph     // BDF/PSF bitmaps, 1 bit per pixel, MSB first
+    {
+        const unsigned char* bits;
+        int stride;
+        int operator () (int row, int col) const
+        { return (bits[row*stride + (col >> 3)] >> (7 - (col & 7))) & 1 ? 15 : 0; }
+    };
+
+    struct alpha_glyph    // cached SDL_ttf glyphs, 0..255 coverage
+    {
+        const unsigned char* cov;
+        int w;
+        int operator () (int row, int col) const
+        { return cov[row*w + col]; }
+    };
+
+    // opaque cell: every coverage value picks one of 16 fg/bg mixtures
+    struct cell_paint
+    {
+        Uint32 ramp[16];
+        cell_paint(int fg, int bg)
+        {
+            for (int v=0; v<16; ++v)
+            {
+                Uint32 mix = 0;
+                for (int c=0; c<32; c+=8)
+                {
+                    Uint32 col = (((bg >> c) & 0xff) * (15-v) + ((fg >> c) & 0xff) * v) / 15;
+                    mix |= col << c;
+                }
+                ramp[v] = mix;
+            }
+        }
+        void operator () (Uint32& pix, int v) const { pix = ramp[v]; }
+    };
+
+    // text over the existing pixels
+    struct over_paint
+    {
+        int clr;
+        int max;
+        void operator () (Uint32& pix, int v) const
+        {
+            if (v == max)
+                pix = clr;
+            else if (v)
+                for (int c=0; c<32; c+=8)   // with the alpha of alpha canvases
+                {
+                    int col = (((pix >> c) & 0xff) * (max-v) + ((clr >> c) & 0xff) * v) / max;
+                    pix = (pix & ~(0xffu << c)) | (col << c);
+                }
+        }
+    };
+
+    // glyph rows and columns from row0, col0 on, for a part of a glyph
+    template <typename Glyph>
+    struct glyph_part
+    {
+        const Glyph& g;
+        int row0, col0;
+        int operator () (int row, int col) const
+        { return g(row0 + row, col0 + col); }
+    };
+
+    // The fixed cell blitter on the clipped rows and columns, for one pixel
+    // access (see with_pixel_access).
+    template <typename Glyph, typename Paint>
+    struct glyph_job
+    {
+        SDL_Surface* screen;
+        int x, y, col0, col1, row0, row1;
+        const Glyph& g;
+        const Paint& paint;
+
+        template <typename P>
+        void operator () (P) const
+        {
+            for (int row = row0; row < row1; ++row)
+            {
+                typename P::row line = P::row_of(screen, y + row);
+                for (int col = col0; col < col1; ++col)
+                {
+                    Uint32 v = P::get(line, x + col);
+                    if (P::byte_lanes) {
+                        Uint32 was = v;
+                        paint(v, g(row, col));
+                        if (v != was)
+                            P::put(line, x + col, v);
+                    } else {
+                        // painted as 0xRRGGBB, see glyph_color
+                        Uint8 r, gr, b;
+                        SDL_GetRGB(v, screen->format, &r, &gr, &b);
+                        Uint32 rgb = static_cast<Uint32>(r) << 16 | gr << 8 | b, was = rgb;
+                        paint(rgb, g(row, col));
+                        if (rgb != was)
+                            P::put(line, x + col, map_rgb(screen, rgb));
+                    }
+                }
+            }
+        }
+    };
+
+    // The fixed cell blitter, clipped to the surface, row by row.
+    template <typename Glyph, typename Paint>
+    void blit_glyph(SDL_Surface* screen, int x, int y, int w, int h, const Glyph& g, const Paint& paint, bool tiled)
+    {
+        int col0 = std::max(0, -x), col1 = std::min(w, screen->w - x);
+        int row0 = std::max(0, -y), row1 = std::min(h, screen->h - y);
+        if (col0 >= col1 || row0 >= row1)
+            return;
+        glyph_job<Glyph, Paint> job = { screen, x, y, col0, col1, row0, row1, g, paint };
+        with_pixel_access(screen, job, tiled);
+    }
+
+    // the blitter over the parts of a canvas rectangle, see canvas::pieces
+    template <typename Glyph, typename Paint>
+    void blit_glyph(SDL_Surface* screen, const SDL_Rect* part, const SDL_Rect* off, int n,
+                    const Glyph& g, const Paint& paint, bool tiled = false)
+    {
+        for (int i=0; i<n; ++i)
+        {
+            glyph_part<Glyph> gp = { g, off[i].y, off[i].x };
+            blit_glyph(screen, part[i].x, part[i].y, part[i].w, part[i].h, gp, paint, tiled);
+        }
+    }
+
+    // Decodes one UTF-8 sequence, invalid bytes are taken as Latin-1.
+    unsigned next_utf8(const char*& p, const char* end)
+    {
+        unsigned c = static_cast<unsigned char>(*p++);
+        int n = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : c >= 0xc0 ? 1 : 0;
+        if (n == 0 || end - p < n)
+            return c;
+        unsigned cp = c & (0x3f >> n);
+        for (int i=0; i<n; ++i)
+        {
+            unsigned char b = static_cast<unsigned char>(p[i]);
+            if ((b & 0xc0) != 0x80)
+                return c;
+            cp = (cp << 6) | (b & 0x3f);
+        }
+        p += n;
+        return cp;
+    }
+
+    // Sparse Unicode index: pages of 256 code points, only the used ones stored.
+    class code_index
+    {
+    public:
+        int find(unsigned cp) const
+        {
+            unsigned pg = cp >> 8;
+            if (pg < pages.size() && pages[pg] >= 0)
+                return values[pages[pg] + (cp & 0xff)];
+            return -1;
+        }
+
+        // the first value given for a code point is kept
+        void add(unsigned cp, int val)
+        {
+            if (cp > 0x10ffff)
+                return;
+            unsigned pg = cp >> 8;
+            if (pg >= pages.size())
+                pages.resize(pg + 1, -1);
+            if (pages[pg] < 0) {
+                pages[pg] = static_cast<int>(values.size());
+                values.resize(values.size() + 256, -1);
+            }
+            int& v = values[pages[pg] + (cp & 0xff)];
+            if (v < 0)
+                v = val;
+        }
+
+    private:
+        std::vector<int> pages;     // code point >> 8 -> offset in values or -1
+        std::vector<int> values;
+    };
+
+    // Memory mapping of a whole file, read-only, or writable for the tiles
+    // of a mapped_canvas.
+    class mapped_file
+    {
+    public:
+        mapped_file() : data(0), size(0)
+#ifdef _WIN32
+            , file(INVALID_HANDLE_VALUE), mapping(0)
+#endif
+        {}
+        ~mapped_file() { close(); }
+
+        bool open(const char* fname) { return map(fname, false, 0); }
+        // read and write; with new_size a new file of that many zero bytes
+        bool open_rw(const char* fname, std::size_t new_size = 0) { return map(fname, true, new_size); }
+        // writes the changed pages to the file now
+        void flush();
+        void close();
+
+        unsigned char* data;
+        std::size_t size;
+
+    private:
+        mapped_file(const mapped_file&);
+        mapped_file& operator=(const mapped_file&);
+        bool map(const char* fname, bool rw, std::size_t new_size);
+#ifdef _WIN32
+        HANDLE file, mapping;
+#endif
+    };
+
+#ifdef _WIN32
+    bool mapped_file::map(const char* fname, bool rw, std::size_t new_size)
+    {
+        close();
+        file = rw ? CreateFileA(fname, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, 0,
+                                new_size ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0)
+                  : CreateFileA(fname, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER len;
+        len.QuadPart = static_cast<LONGLONG>(new_size);
+        if (new_size && (!SetFilePointerEx(file, len, 0, FILE_BEGIN) || !SetEndOfFile(file))) {
+            close();
+            return false;
+        }
+        if (!GetFileSizeEx(file, &len) || len.QuadPart == 0) {
+            close();
+            return false;
+        }
+        mapping = CreateFileMappingA(file, 0, rw ? PAGE_READWRITE : PAGE_READONLY, 0, 0, 0);
+        if (mapping)
+            data = static_cast<unsigned char*>(MapViewOfFile(mapping, rw ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0));
+        if (data == 0) {
+            close();
+            return false;
+        }
+        size = static_cast<std::size_t>(len.QuadPart);
+        return true;
+    }
+
+    void mapped_file::flush()
+    {
+        if (data && FlushViewOfFile(data, 0))
+            FlushFileBuffers(file);
+    }
+
+    void mapped_file::close()
+    {
+        if (data) UnmapViewOfFile(data);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        data = 0;
+        size = 0;
+        mapping = 0;
+        file = INVALID_HANDLE_VALUE;
+    }
+#else
+    bool mapped_file::map(const char* fname, bool rw, std::size_t new_size)
+    {
+        close();
+        int fd = ::open(fname, rw ? O_RDWR | (new_size ? O_CREAT | O_TRUNC : 0) : O_RDONLY, 0644);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        // the size must survive off_t and back to size_t on 32 bit systems
+        if ((new_size == 0 || ftruncate(fd, static_cast<off_t>(new_size)) == 0) &&
+            fstat(fd, &st) == 0 && st.st_size > 0 &&
+            static_cast<unsigned long long>(st.st_size) <= static_cast<std::size_t>(-1) &&
+            (new_size == 0 || static_cast<unsigned long long>(st.st_size) == new_size)) {
+            void* p = mmap(0, st.st_size, rw ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+            if (p != MAP_FAILED) {
+                data = static_cast<unsigned char*>(p);
+                size = st.st_size;
+            }
+        }
+        ::close(fd);
+        return data != 0;
+    }
+
+    void mapped_file::flush()
+    {
+        if (data)
+            msync(data, size, MS_SYNC);
+    }
+
+    void mapped_file::close()
+    {
+        if (data) munmap(data, size);
+        data = 0;
+        size = 0;
+    }
+#endif
+
+    int findkey(pairptr begin, pairptr end, int key)
+    {
+        while (begin < end)
+        {
+            pairptr med = begin + (end-begin)/2;
+            int mk = (*med)[0];
+            if (mk == key)
+                return (*med)[1];
+            else if (mk < key)
+                begin = med+1;
+            else
+                end = med;
+        }
+        return 0;
+    }
+
+    int mkkeycode(int sym)
+    {
+        int mysym = findkey(keysym_tbl, keysym_end, sym);
+        if (mysym != 0) 
+        {
+            return mysym;
+        }
+        else
+        {
+            return sym;
+        }
+    }
+
+    Uint32 timer_event(Uint32 interval, void*)
+    {
+        SDL_Event ev;
+        ev.type = SDL_USEREVENT;
+        ev.user.code = SDL_GetTicks();
+        ev.user.data1 = 0;
+        ev.user.data2 = 0;
+        SDL_PushEvent(&ev);
+
+        return interval;
+    }
+}
+
+// Fixed cell bitmap font from a BDF or PSF file. PSF glyphs are used straight
+// from the mapped file, BDF glyphs are converted into cells once.
+class genv::bitmap_font
+{
+public:
+    bitmap_font() : width(0), height(0), ascent(0), stride(0), glyph_bytes(0),
+                    glyphs(0), nglyphs(0), missing(0) {}
+
+    bool load(const char* fname);
+
+    int lookup(unsigned cp) const
+    {
+        int g = index.find(cp);
+        return g >= 0 ? g : missing;
+    }
+
+    const unsigned char* glyph(int idx) const { return glyphs + idx * glyph_bytes; }
+
+    int width, height, ascent;
+    int stride, glyph_bytes;
+
+private:
+    bool load_psf1();
+    bool load_psf2();
+    bool load_bdf();
+
+    mapped_file file;
+    const unsigned char* glyphs;
+    int nglyphs;
+    std::vector<unsigned char> owned;   // BDF glyph cells
+    code_index index;
+    int missing;
+};
+
+// SDL_ttf glyph coverage and metrics of one font file and size, kept in
+// memory and, when a cache directory is set, in a file mapped on startup.
+//
+// File layout: cache_header, 'count' cache_entry records, coverage bytes.
+// The file name holds a hash of the font's path and the size. The header
+// has the length, time and content hash of the font: the contents are
+// hashed only when the time differs, and the file is rebuilt when they do
+// not match.
+class genv::glyph_cache
+{
+public:
+    struct glyph
+    {
+        unsigned cp;
+        int x, y, w, h;         // covered box inside the rendered character
+        int advance;
+        std::size_t offset;     // of the coverage bytes
+        bool mapped;            // in the cache file, or rendered since
+    };
+
+    static std::shared_ptr<glyph_cache> open(const char* fname, int size, bool antialias);
+    ~glyph_cache();
+    // writes new glyphs to the file: the first ones at once, later ones
+    // at most every few seconds
+    void flush();
+
+    // rasterizes the glyph on the first request
+    const glyph& get(_TTF_Font* font, unsigned cp);
+    // null for glyphs that cover nothing (spaces)
+    const unsigned char* coverage(const glyph& g) const
+    {
+        if (g.w == 0 || g.h == 0)
+            return 0;
+        return g.mapped ? file.data + cov_start + g.offset : fresh.data() + g.offset;
+    }
+
+    bool antialias;
+
+private:
+    glyph_cache() : antialias(true), font_hash(0), font_len(0), font_time(0), size(0), cov_start(0),
+                    dirty(false), saved(false), saved_at(0) {}
+    bool load();
+    bool save();
+    Uint64 content_hash();
+
+    std::string path;
+    std::string font_file;
+    Uint64 font_hash, font_len, font_time;  // font_hash: 0 until needed
+    int size;
+    mapped_file file;
+    std::size_t cov_start;
+    std::vector<glyph> glyphs;
+    code_index index;
+    std::vector<unsigned char> fresh;
+    bool dirty;
+    bool saved;
+    Uint32 saved_at;    // SDL_GetTicks() of the last flush()
+};
+
+namespace
+{
+    std::string glyph_cache_dir;
+    // caches of the open fonts, shared by the canvases using the same one
+    std::vector<std::weak_ptr<genv::glyph_cache> > glyph_caches;
+
+    const char cache_magic[8] = { 'G','E','N','V','G','L','Y','F' };
+    const Uint32 cache_version = 2;
+
+    struct cache_header
+    {
+        char magic[8];
+        Uint32 version;
+        Uint32 size;
+        Uint32 antialias;
+        Uint32 count;
+        Uint64 font_hash;
+        Uint64 font_len;
+        Uint64 font_time;
+        Uint64 coverage_len;
+    };
+
+    struct cache_entry
+    {
+        Uint32 cp;
+        Sint16 x, y;
+        Uint16 w, h;
+        Sint32 advance;
+        Uint32 offset;
+    };
+
+    Uint64 fnv1a(const unsigned char* p, std::size_t n)
+    {
+        Uint64 h = 14695981039346656037ull;
+        for (std::size_t i=0; i<n; ++i)
+            h = (h ^ p[i]) * 1099511628211ull;
+        return h;
+    }
+
+    // length and modification time of a file, to notice that it changed
+    bool file_stamp(const char* fname, Uint64& len, Uint64& time)
+    {
+#ifdef _WIN32
+        WIN32_FILE_ATTRIBUTE_DATA a;
+        if (!GetFileAttributesExA(fname, GetFileExInfoStandard, &a))
+            return false;
+        len = (static_cast<Uint64>(a.nFileSizeHigh) << 32) | a.nFileSizeLow;
+        time = (static_cast<Uint64>(a.ftLastWriteTime.dwHighDateTime) << 32) | a.ftLastWriteTime.dwLowDateTime;
+#else
+        struct stat st;
+        if (stat(fname, &st) != 0)
+            return false;
+        len = st.st_size;
+        time = st.st_mtime;
+#endif
+        return true;
+    }
+
+    int put_utf8(unsigned cp, char* out)
+    {
+        if (cp < 0x80) {
+            out[0] = static_cast<char>(cp);
+            return 1;
+        }
+        if (cp < 0x800) {
+            out[0] = static_cast<char>(0xc0 | (cp >> 6));
+            out[1] = static_cast<char>(0x80 | (cp & 0x3f));
+            return 2;
+        }
+        if (cp < 0x10000) {
+            out[0] = static_cast<char>(0xe0 | (cp >> 12));
+            out[1] = static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+            out[2] = static_cast<char>(0x80 | (cp & 0x3f));
+            return 3;
+        }
+        out[0] = static_cast<char>(0xf0 | (cp >> 18));
+        out[1] = static_cast<char>(0x80 | ((cp >> 12) & 0x3f));
+        out[2] = static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+        out[3] = static_cast<char>(0x80 | (cp & 0x3f));
+        return 4;
+    }
+}
+
+std::shared_ptr<genv::glyph_cache> genv::glyph_cache::open(const char* fname, int size, bool antialias)
+{
+    Uint64 len, time;
+    if (!file_stamp(fname, len, time))
+        return std::shared_ptr<glyph_cache>();
+    Uint64 hash = fnv1a(reinterpret_cast<const unsigned char*>(fname), std::strlen(fname));
+
+    char name[64];
+    std::snprintf(name, sizeof(name), "/%016llx-%d%c.gcache",
+                  static_cast<unsigned long long>(hash), size, antialias ? 'a' : 's');
+    std::string path = glyph_cache_dir + name;
+
+    for (size_t i=0; i<glyph_caches.size(); ++i) {
+        std::shared_ptr<glyph_cache> c = glyph_caches[i].lock();
+        if (c && c->path == path)
+            return c;
+    }
+
+    std::shared_ptr<glyph_cache> c(new glyph_cache);
+    c->path = path;
+    c->font_file = fname;
+    c->font_len = len;
+    c->font_time = time;
+    c->size = size;
+    c->antialias = antialias;
+    if (!c->load()) { // missing, stale or damaged: start over, see flush()
+        c->file.close();
+        c->glyphs.clear();
+        c->index = code_index();
+    }
+
+    size_t i = 0;
+    while (i < glyph_caches.size() && !glyph_caches[i].expired())
+        ++i;
+    if (i == glyph_caches.size())
+        glyph_caches.push_back(c);
+    else
+        glyph_caches[i] = c;
+    return c;
+}
+
+genv::glyph_cache::~glyph_cache()
+{
+    if (dirty)
+        save();
+}
+
+void genv::glyph_cache::flush()
+{
+    Uint32 now = SDL_GetTicks();
+    if (!dirty || (saved && now - saved_at < 5000))
+        return;
+    saved = true;
+    saved_at = now;
+    if (!save())
+        return;
+    // the old file is gone, the glyphs are read back from the new one (or
+    // rendered again)
+    glyphs.clear();
+    index = code_index();
+    fresh.clear();
+    dirty = false;
+    if (!load()) {
+        file.close();
+        glyphs.clear();
+        index = code_index();
+    }
+}
+
+bool genv::glyph_cache::load()
+{
+    if (!file.open(path.c_str()) || file.size < sizeof(cache_header))
+        return false;
+    cache_header hdr;
+    std::memcpy(&hdr, file.data, sizeof(hdr));
+    if (std::memcmp(hdr.magic, cache_magic, sizeof(cache_magic)) != 0 || hdr.version != cache_version ||
+        hdr.size != static_cast<Uint32>(size) || hdr.antialias != static_cast<Uint32>(antialias) ||
+        hdr.font_len != font_len)
+        return false;
+    if (hdr.font_time != font_time) {
+        // copied or touched, still the same font if the contents match
+        if (hdr.font_hash != content_hash())
+            return false;
+        dirty = true;   // to write the new time
+    }
+    font_hash = hdr.font_hash;
+    cov_start = sizeof(hdr) + static_cast<std::size_t>(hdr.count) * sizeof(cache_entry);
+    if (cov_start > file.size || hdr.coverage_len != file.size - cov_start)
+        return false;
+
+    glyphs.reserve(hdr.count);
+    for (Uint32 i=0; i<hdr.count; ++i) {
+        cache_entry e;
+        std::memcpy(&e, file.data + sizeof(hdr) + i * sizeof(e), sizeof(e));
+        if (e.offset + static_cast<Uint64>(e.w) * e.h > hdr.coverage_len)
+            return false;
+        glyph g = { e.cp, e.x, e.y, e.w, e.h, e.advance, e.offset, true };
+        index.add(e.cp, static_cast<int>(glyphs.size()));
+        glyphs.push_back(g);
+    }
+    return true;
+}
+
+// false if nothing was written, true once the mapped file is let go
+bool genv::glyph_cache::save()
+{
+    std::vector<cache_entry> entries;
+    cache_header hdr;
+    std::memcpy(hdr.magic, cache_magic, sizeof(cache_magic));
+    hdr.version = cache_version;
+    hdr.size = size;
+    hdr.antialias = antialias;
+    hdr.count = static_cast<Uint32>(glyphs.size());
+    hdr.font_hash = content_hash();
+    hdr.font_len = font_len;
+    hdr.font_time = font_time;
+    Uint32 offset = 0;
+    for (size_t i=0; i<glyphs.size(); ++i) {
+        const glyph& g = glyphs[i];
+        cache_entry e = { g.cp, static_cast<Sint16>(g.x), static_cast<Sint16>(g.y),
+                          static_cast<Uint16>(g.w), static_cast<Uint16>(g.h), g.advance, offset };
+        entries.push_back(e);
+        offset += g.w * g.h;
+    }
+    hdr.coverage_len = offset;
+
+    std::string tmp = path + ".tmp";
+    FILE* f = std::fopen(tmp.c_str(), "wb");
+    if (f == 0)
+        return false;
+    bool ok = std::fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+    if (!entries.empty())
+        ok = ok && std::fwrite(&entries[0], sizeof(cache_entry), entries.size(), f) == entries.size();
+    for (size_t i=0; ok && i<glyphs.size(); ++i) {
+        std::size_t n = glyphs[i].w * glyphs[i].h;
+        ok = n == 0 || std::fwrite(coverage(glyphs[i]), 1, n, f) == n;
+    }
+    ok = std::fclose(f) == 0 && ok;
+    file.close();
+    if (ok) {
+#ifdef _WIN32
+        std::remove(path.c_str());
+#endif
+        ok = std::rename(tmp.c_str(), path.c_str()) == 0;
+    }
+    if (!ok)
+        std::remove(tmp.c_str());
+    return true;
+}
+
+Uint64 genv::glyph_cache::content_hash()
+{
+    mapped_file f;
+    if (font_hash == 0 && f.open(font_file.c_str()))
+        font_hash = fnv1a(f.data, f.size);
+    return font_hash;
+}
+
+const genv::glyph_cache::glyph& genv::glyph_cache::get(_TTF_Font* font, unsigned cp)
+{
+    int i = index.find(cp);
+    if (i >= 0)
+        return glyphs[i];
+
+    // render the character the way draw_text renders a string, keep the
+    // covered box only
+    char str[5];
+    str[put_utf8(cp, str)] = 0;
+    SDL_Color white = { 0xff, 0xff, 0xff, 0xff };
+    SDL_Surface* t = antialias ? TTF_RenderUTF8_Blended(font, str, white)
+                               : TTF_RenderUTF8_Solid(font, str, white);
+    glyph g = { cp, 0, 0, 0, 0, 0, fresh.size(), false };
+    int minx, maxx, miny, maxy, adv, h;
+    if (cp <= 0xffff && TTF_GlyphMetrics(font, static_cast<Uint16>(cp), &minx, &maxx, &miny, &maxy, &adv) == 0)
+        g.advance = adv;
+    else if (TTF_SizeUTF8(font, str, &adv, &h) == 0)
+        g.advance = adv;
+
+    if (t) {
+        SDL_LockSurface(t);
+        std::vector<unsigned char> cov(t->w * t->h);
+        int x0 = t->w, y0 = t->h, x1 = -1, y1 = -1;
+        for (int y=0; y<t->h; ++y)
+            for (int x=0; x<t->w; ++x) {
+                const Uint8* row = static_cast<const Uint8*>(t->pixels) + y * t->pitch;
+                unsigned char a;
+                if (t->format->BytesPerPixel == 1) {
+                    a = row[x] ? 0xff : 0;
+                } else {
+                    Uint8 r, gr, b;
+                    SDL_GetRGBA(reinterpret_cast<const Uint32*>(row)[x], t->format, &r, &gr, &b, &a);
+                }
+                cov[y * t->w + x] = a;
+                if (a) {
+                    x0 = std::min(x0, x); x1 = std::max(x1, x);
+                    y0 = std::min(y0, y); y1 = std::max(y1, y);
+                }
+            }
+        SDL_UnlockSurface(t);
+        if (x1 >= 0) {
+            g.x = x0;
+            g.y = y0;
+            g.w = x1 - x0 + 1;
+            g.h = y1 - y0 + 1;
+            for (int y=y0; y<=y1; ++y)
+                fresh.insert(fresh.end(), cov.begin() + y * t->w + x0, cov.begin() + y * t->w + x1 + 1);
+        }
+        SDL_FreeSurface(t);
+    }
+
+    index.add(cp, static_cast<int>(glyphs.size()));
+    glyphs.push_back(g);
+    dirty = true;
+    return glyphs.back();
+}
+
+namespace
+{
+    inline unsigned le32(const unsigned char* p)
+    {
+        return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<unsigned>(p[3]) << 24);
+    }
+}
+
+bool genv::bitmap_font::load(const char* fname)
+{
+    if (!file.open(fname))
+        return false;
+    const unsigned char* d = file.data;
+    bool ok = false;
+    if (file.size >= 4 && d[0] == 0x36 && d[1] == 0x04)
+        ok = load_psf1();
+    else if (file.size >= 32 && le32(d) == 0x864ab572)
+        ok = load_psf2();
+    else if (file.size >= 9 && std::memcmp(d, "STARTFONT", 9) == 0)
+        ok = load_bdf();
+    if (!ok || nglyphs == 0 || width <= 0 || height <= 0)
+        return false;
+
+    missing = 0;
+    missing = lookup('?');
+    return true;
+}
+
+bool genv::bitmap_font::load_psf1()
+{
+    const unsigned char* d = file.data;
+    int mode = d[2];
+    width = 8;
+    height = d[3];
+    stride = 1;
+    glyph_bytes = height;
+    nglyphs = mode & 1 ? 512 : 256;
+    std::size_t table = 4 + static_cast<std::size_t>(nglyphs) * glyph_bytes;
+    if (table > file.size)
+        return false;
+    glyphs = d + 4;
+    ascent = height - height/4;
+
+    if (mode & 6) { // unicode table: uint16 values, 0xfffe starts sequences, 0xffff ends a glyph
+        const unsigned char* p = d + table;
+        const unsigned char* end = d + file.size;
+        for (int g = 0; g < nglyphs && end - p >= 2; ++g) {
+            bool seq = false;
+            while (end - p >= 2) {
+                unsigned v = p[0] | (p[1] << 8);
+                p += 2;
+                if (v == 0xffff)
+                    break;
+                if (v == 0xfffe)
+                    seq = true;
+                else if (!seq)
+                    index.add(v, g);
+            }
+        }
+    } else {
+        for (int g = 0; g < nglyphs; ++g)
+            index.add(g, g);
+    }
+    return true;
+}
+
+bool genv::bitmap_font::load_psf2()
+{
+    const unsigned char* d = file.data;
+    unsigned headersize = le32(d + 8), flags = le32(d + 12), length = le32(d + 16);
+    unsigned charsize = le32(d + 20);
+    height = static_cast<int>(le32(d + 24));
+    width = static_cast<int>(le32(d + 28));
+    if (width <= 0 || height <= 0 || width > 256 || height > 256 || length > 0x110000)
+        return false;
+    stride = (width + 7) / 8;
+    glyph_bytes = static_cast<int>(charsize);
+    nglyphs = static_cast<int>(length);
+    std::size_t table = headersize + static_cast<std::size_t>(length) * charsize;
+    if (charsize < static_cast<unsigned>(stride * height) || table > file.size)
+        return false;
+    glyphs = d + headersize;
+    ascent = height - height/4;
+
+    if (flags & 1) { // unicode table: UTF-8, 0xfe starts sequences, 0xff ends a glyph
+        const char* p = reinterpret_cast<const char*>(d + table);
+        const char* end = reinterpret_cast<const char*>(d + file.size);
+        for (int g = 0; g < nglyphs && p < end; ++g) {
+            bool seq = false;
+            while (p < end) {
+                unsigned char b = static_cast<unsigned char>(*p);
+                if (b == 0xff) {
+                    ++p;
+                    break;
+                }
+                if (b == 0xfe) {
+                    seq = true;
+                    ++p;
+                    continue;
+                }
+                unsigned cp = next_utf8(p, end);
+                if (!seq)
+                    index.add(cp, g);
+            }
+        }
+    } else {
+        for (int g = 0; g < nglyphs; ++g)
+            index.add(g, g);
+    }
+    return true;
+}
+
+bool genv::bitmap_font::load_bdf()
+{
+    const char* p = reinterpret_cast<const char*>(file.data);
+    const char* end = p + file.size;
+    int fw = 0, fh = 0, fx = 0, fy = 0;
+    int fa = -1, fd = -1;
+    int enc = -1, bw = 0, bh = 0, bx = 0, by = 0;
+    int rows_left = 0, row = 0;
+    unsigned char* cell = 0;
+    char line[256];
+
+    while (p < end) {
+        const char* eol = std::find(p, end, '\n');
+        std::size_t n = std::min<std::size_t>(eol - p, sizeof(line) - 1);
+        std::memcpy(line, p, n);
+        line[n] = 0;
+        p = eol < end ? eol + 1 : end;
+
+        if (rows_left > 0) { // one hex row of the current BITMAP
+            if (cell) {
+                int cy = row + ascent - (by + bh);
+                for (int c = 0; c < bw && cy >= 0 && cy < height; ++c) {
+                    const char* h = line + c/4;
+                    if (h >= line + n)
+                        break;
+                    int v = *h <= '9' ? *h - '0' : (*h | 0x20) - 'a' + 10;
+                    int cx = bx - fx + c;
+                    if ((v >> (3 - c%4)) & 1 && cx >= 0 && cx < width)
+                        cell[cy*stride + cx/8] |= 0x80 >> (cx & 7);
+                }
+            }
+            ++row;
+            --rows_left;
+            continue;
+        }
+
+        if (std::sscanf(line, "FONTBOUNDINGBOX %d %d %d %d", &fw, &fh, &fx, &fy) == 4)
+            continue;
+        if (std::sscanf(line, "FONT_ASCENT %d", &fa) == 1 || std::sscanf(line, "FONT_DESCENT %d", &fd) == 1)
+            continue;
+        if (std::strncmp(line, "CHARS ", 6) == 0) { // glyphs follow, the cell size is known now
+            ascent = fa >= 0 ? fa : fh + fy;
+            height = ascent + (fd >= 0 ? fd : -fy);
+            width = fw;
+            if (width <= 0 || height <= 0)
+                return false;
+            stride = (width + 7) / 8;
+            glyph_bytes = stride * height;
+            continue;
+        }
+        if (std::strncmp(line, "STARTCHAR", 9) == 0) {
+            enc = -1;
+            bw = bh = bx = by = 0;
+            continue;
+        }
+        if (std::sscanf(line, "ENCODING %d", &enc) == 1 || std::sscanf(line, "BBX %d %d %d %d", &bw, &bh, &bx, &by) == 4)
+            continue;
+        if (std::strncmp(line, "BITMAP", 6) == 0) {
+            rows_left = bh;
+            row = 0;
+            cell = 0;
+            if (enc >= 0 && glyph_bytes > 0) {
+                owned.resize(owned.size() + glyph_bytes, 0);
+                cell = &owned[owned.size() - glyph_bytes];
+                index.add(enc, nglyphs++);
+            }
+        }
+    }
+
+    glyphs = owned.empty() ? 0 : &owned[0];
+    file.close();
+    return true;
+}
+
+genv::canvas::canvas() {
+    buf=0;
+    transp=0;
+    antialiastext=true;
+    ring=false;
+    org_x=org_y=0;
+    alpha=false;
+    compact=-1;
+    tiled=false;
+    owner=0;
+    changes=0;
+    mipmap=false;
+    derived=false;
+    shared=false;
+    pinned=false;
+    set_color(255,255,255);
+}
+
+genv::canvas& genv::canvas::operator=(const genv::canvas& c) {
+    if (this == &c)
+        return *this;
+    pt_x=c.pt_x;
+    pt_y=c.pt_y;
+    draw_rgb = c.draw_rgb;
+    draw_clr = c.draw_clr;
+    transp = c.transp;
+    antialiastext = c.antialiastext;
+    bmfont = c.bmfont;
+    // the font is shared too, not opened again
+    font = c.font;
+    font_size = c.font_size;
+    loaded_font_file_name = c.loaded_font_file_name;
+    gcache = c.gcache;
+    mipmap = c.mipmap;
+    if (pinned) {
+        // the window, a parent of views or a mapped canvas keeps its pixels
+        // and their layout, views keep working
+        paste(c);
+        return *this;
+    }
+    ring = c.ring;
+    org_x = c.org_x;
+    org_y = c.org_y;
+    alpha = c.alpha;
+    compact = c.compact;
+    palette = c.palette;
+    tiled = c.tiled;
+    owner = 0;          // a copy of a view has its own pixels
+    ++changes;
+    // nothing is derived from the new pixels yet
+    derived = true;
+    drop_derived();
+
+    SDL_Surface* old = buf;
+    buf = 0;
+    shared = false;
+    if (c.buf) {
+        if (c.buf->format->format == own_format() && !c.pinned && !c.owner) {
+            // the same pixels until either of them draws, see unshare()
+            buf = c.buf;
+            ++buf->refcount;
+            shared = c.shared = true;
+        } else {
+            // the copy is converted to the window format, if not in that
+            // already; tiles go through rows
+            SDL_Surface* rows = c.tiled ? c.rows_copy() : c.buf;
+            buf = rows ? converted(rows) : 0;
+            if (rows != c.buf)
+                free_surface(rows);
+            if (buf && tiled)
+                buf = in_tiles(buf);
+        }
+        if (buf)
+            draw_clr = map_rgb(buf, draw_rgb, alpha);
+    }
+    free_surface(old);
+	return *this;
+
+}
+
+genv::canvas::canvas(canvas&& c) noexcept : canvas()
+{
+    *this = std::move(c);
+}
+
+genv::canvas& genv::canvas::operator=(canvas&& c) noexcept
+{
+    if (this == &c)
+        return *this;
+    pt_x = c.pt_x;
+    pt_y = c.pt_y;
+    draw_rgb = c.draw_rgb;
+    draw_clr = c.draw_clr;
+    transp = c.transp;
+    antialiastext = c.antialiastext;
+    font = std::move(c.font);
+    loaded_font_file_name = std::move(c.loaded_font_file_name);
+    font_size = c.font_size;
+    bmfont = std::move(c.bmfont);
+    gcache = std::move(c.gcache);
+    mipmap = c.mipmap;
+    if (pinned) {
+        // keeps its pixels, see operator=(const canvas&)
+        paste(c);
+        return *this;
+    }
+    ring = c.ring;
+    org_x = c.org_x;
+    org_y = c.org_y;
+    alpha = c.alpha;
+    compact = c.compact;
+    palette.swap(c.palette);
+    tiled = c.tiled;
+    ++changes;
+    ++c.changes;
+    // the pixels move with what was derived from them; moved from a view,
+    // they still belong to its parent, moved from a parent of views, the
+    // views show them without telling this canvas
+    free_surface(buf);
+    buf = c.buf;
+    c.buf = 0;
+    owner = c.owner;
+    shared = c.shared;
+    pinned = c.pinned;
+    c.owner = 0;
+    c.shared = c.pinned = false;
+    derived = c.derived;
+    sprite_spans.swap(c.sprite_spans);
+    sprite_rows.swap(c.sprite_rows);
+    mip_levels.swap(c.mip_levels);
+    c.drop_derived();
+    return *this;
+}
+
+genv::canvas::canvas(const genv::canvas & c) : canvas() {
+    //az esetek nagy részében nem jó ötlet másoló konstruktorban értékadást használni, mert érdemes kihasználni, hogy a : operátorral örökíthetőek a mező konstruktorok. Ez a kód refaktorálásra szorulhat a jövőben, ha sok mező konstruktor-lefutása megspórolható lehet, jelenleg nincs ilyen mező, ezért használhatunk értékadást érdemi lassulás nélkül
+	*this = c;
+}
+
+genv::canvas::canvas(int w, int h) {
+    buf=0;
+    loaded_font_file_name="";
+    transp=0;
+    antialiastext=true;
+    ring=false;
+    org_x=org_y=0;
+    alpha=false;
+    compact=-1;
+    tiled=false;
+    owner=0;
+    changes=0;
+    mipmap=false;
+    derived=false;
+    shared=false;
+    pinned=false;
+    set_color(255,255,255);
+    open(w,h);
+}
+
+namespace
+{
+    // gray ramp, 3-3-2 colors, black and white
+    std::vector<unsigned> default_palette(int f)
+    {
+        std::vector<unsigned> p;
+        if (f == genv::compact_gray8)
+            for (unsigned i = 0; i < 256; ++i)
+                p.push_back(i * 0x010101);
+        else if (f == genv::compact_indexed8)
+            for (unsigned i = 0; i < 256; ++i)
+                p.push_back((i >> 5) * 255 / 7 << 16 | ((i >> 2) & 7) * 255 / 7 << 8 | (i & 3) * 255 / 3);
+        else if (f == genv::compact_mask1)
+            p.push_back(0), p.push_back(0xffffff);
+        return p;
+    }
+}
+
+genv::compact_canvas::compact_canvas(compact_format f)
+{
+    compact = f;
+    palette = default_palette(f);
+}
+
+genv::compact_canvas::compact_canvas(int w, int h, compact_format f)
+{
+    compact = f;
+    palette = default_palette(f);
+    open(w, h);
+}
+
+void genv::compact_canvas::set_palette(const int* rgb, int n)
+{
+    if (compact != compact_indexed8)
+        return;
+    touch();
+    palette.assign(256, 0);
+    for (int i = 0; i < std::min(n, 256); ++i)
+        palette[i] = rgb[i] & 0xffffff;
+    if (buf) {
+        // the stored indices stay, they show the new colors
+        set_palette_colors(buf, palette);
+        draw_clr = map_rgb(buf, draw_rgb);
+    }
+}
+
+
+genv::groutput::groutput()
+{
+    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER) < 0)
+        exit(1);
+    // SDL_EnableUNICODE(1);
+    buf = 0;
+    screen = 0;
+    zoom = 1;
+    if (TTF_Init() < 0)
+      exit(1);
+}
+
+genv::groutput::~groutput()
+{
+    free_surface(buf);
+    if (wnd) SDL_DestroyWindow(wnd);
+    font.reset();
+    buf=0;
+    antialiastext=0;
+    SDL_Quit();
+    TTF_Quit();
+}
+
+
+genv::canvas::~canvas() {
+    free_surface(buf);
+}
+
+bool genv::canvas::open(unsigned width, unsigned height)
+{
+    shared = false;     // nothing to copy, buf is let go below
+    touch();
+    free_surface(buf);
+    buf = new_surface(width, height);
+    org_x = org_y = 0;
+    if (buf == 0)
+        return false;
+    draw_clr = map_rgb(buf, draw_rgb, alpha);
+    pt_x = width/2;
+    pt_y = height/2;
+    return true;
+}
+
+bool genv::canvas::load(const std::string& file)
+{
+    SDL_Surface* img = SDL_LoadBMP(file.c_str());
+    if (img == 0)
+        return false;
+    SDL_Surface* s = converted(img);
+    SDL_FreeSurface(img);
+    if (s == 0)
+        return false;
+    if (alpha)
+        premultiply(s);
+    if (tiled && (s = in_tiles(s)) == 0)
+        return false;
+    shared = false;
+    touch();
+    free_surface(buf);
+    buf = s;
+    org_x = org_y = 0;
+    draw_clr = map_rgb(buf, draw_rgb, alpha);
+    pt_x = buf->w/2;
+    pt_y = buf->h/2;
+    return true;
+}
+
+int genv::canvas::width() const
+{
+    return buf ? buf->w : 0;
+}
+
+int genv::canvas::height() const
+{
+    return buf ? buf->h : 0;
+}
+
+unsigned genv::canvas::format() const
+{
+    return buf ? buf->format->format : static_cast<Uint32>(SDL_PIXELFORMAT_UNKNOWN);
+}
+
+std::string genv::canvas::format_name() const
+{
+    return SDL_GetPixelFormatName(format());
+}
+
+bool genv::canvas::native() const
+{
+    return buf && buf->format->format == own_format();
+}
+
+unsigned genv::canvas::own_format() const
+{
+    if (compact >= 0)
+        return compact_sdl_format(compact);
+    if (tiled && !alpha && SDL_BYTESPERPIXEL(native_format) != 4)
+        return SDL_PIXELFORMAT_RGB888;  // tiles are of 32 bit pixels
+    return alpha ? alpha_format() : native_format;
+}
+
+SDL_Surface* genv::canvas::new_surface(int w, int h) const
+{
+    SDL_Surface* s = create_surface(w, h, own_format());
+    if (s)
+        set_palette_colors(s, palette);
+    return s;
+}
+
+// src in own_format(); into the compact formats pixel by pixel, see compact_mapper
+SDL_Surface* genv::canvas::converted(SDL_Surface* src) const
+{
+    if (compact < 0)
+        return convert_surface(src, own_format());
+    SDL_Surface* s = new_surface(src->w, src->h);
+    if (s == 0)
+        return 0;
+    compact_mapper to_compact(compact, palette);
+    for (int y = 0; y < src->h; ++y)
+        for (int x = 0; x < src->w; ++x)
+            write_pixel(s, x, y, to_compact(read_rgb(src, x, y)));
+    return s;
+}
+
+SDL_Surface* genv::canvas::rows_copy() const
+{
+    SDL_Surface* s = create_like(buf, buf->w, buf->h);
+    if (s)
+        copy_out(0, 0, buf->w, buf->h, static_cast<unsigned char*>(s->pixels), s->pitch);
+    return s;
+}
+
+bool genv::canvas::convert_to_native()
+{
+    if (buf == 0 || native())
+        return buf != 0;
+    SDL_Surface* rows = tiled ? rows_copy() : buf;
+    SDL_Surface* s = rows ? converted(rows) : 0;
+    if (rows != buf)
+        free_surface(rows);
+    if (s && tiled)
+        s = in_tiles(s);
+    if (s == 0)
+        return false;
+    shared = false;
+    touch();
+    free_surface(buf);
+    buf = s;
+    draw_clr = map_rgb(buf, draw_rgb, alpha);
+    return true;
+}
+
+bool genv::groutput::open(unsigned width, unsigned height, bool fullscreen)
+{
+    return open_scaled(width, height, 1, fullscreen);
+}
+
+bool genv::groutput::open_scaled(unsigned width, unsigned height, int scale, bool fullscreen)
+{
+    zoom = std::max(scale, 1);
+    if (fullscreen) {
+        wnd = SDL_CreateWindow("SDL app", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, width * zoom, height * zoom, SDL_WINDOW_FULLSCREEN);
+    } else {
+        wnd = SDL_CreateWindow("SDL app", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, width * zoom, height * zoom, 0);
+    }
+    touch();
+    screen = SDL_GetWindowSurface(wnd);
+    if (screen == 0)
+        return false;
+    pinned = true;
+    native_format = screen->format->format;
+    // scaled: a canvas of the small size, enlarged by refresh()
+    buf = zoom > 1 ? create_surface(width, height) : screen;
+    if (buf == 0)
+        return false;
+    draw_clr = map_rgb(buf, draw_rgb, alpha);
+    pt_x = width/2;
+    pt_y = height/2;
+    return true;
+}
+
+
+void genv::groutput::showmouse(bool toggle) {
+    if (toggle)
+        SDL_ShowCursor(SDL_ENABLE);
+    else
+        SDL_ShowCursor(SDL_DISABLE);
+}
+void genv::groutput::movemouse(int x, int y) {
+    SDL_WarpMouseInWindow(wnd, x * zoom + zoom / 2, y * zoom + zoom / 2);
+}
+
+bool genv::canvas::save(const std::string& file) const
+{
+    if (buf->format->BitsPerPixel < 8) {
+        // BMP files of SDL have 8 bits per pixel at least
+        SDL_Surface* s = create_surface(buf->w, buf->h, SDL_PIXELFORMAT_INDEX8);
+        if (s == 0)
+            return false;
+        copy_palette(buf, s);
+        for (int y = 0; y < buf->h; ++y)
+            for (int x = 0; x < buf->w; ++x)
+                write_pixel(s, x, y, read_pixel(buf, x, y));
+        bool ok = SDL_SaveBMP(s, file.c_str()) == 0;
+        free_surface(s);
+        return ok;
+    }
+    if (org_x == 0 && org_y == 0 && !tiled)
+        return SDL_SaveBMP(buf, file.c_str()) == 0;
+    // a scrolled ring_canvas is saved from the origin on, a tiled_canvas in rows
+    SDL_Surface* s = rows_copy();
+    if (s == 0)
+        return false;
+    bool ok = SDL_SaveBMP(s, file.c_str()) == 0;
+    free_surface(s);
+    return ok;
+}
+
+void genv::groutput::set_title(const std::string& title) {
+	SDL_SetWindowTitle(wnd, title.c_str());
+}
+
+
+void genv::canvas::set_color(int r, int g, int b, int a)
+{
+    draw_rgb = static_cast<int>((a & 0xffu) << 24 | (r & 0xff) << 16 | (g & 0xff) << 8 | (b & 0xff));
+    draw_clr = buf ? map_rgb(buf, draw_rgb, alpha) : draw_rgb;
+}
+
+bool genv::canvas::move_point(int x, int y)
+{
+    int nx = pt_x + x;
+    int ny = pt_y + y;
+
+    if (nx < 0 || ny < 0 || nx >= buf->w || ny >= buf->h)
+        return false;
+
+    pt_x = nx;
+    pt_y = ny;
+    return true;
+}
+
+void genv::canvas::draw_dot()
+{
+    touch();
+    dot_job job = { buf, wrap_x(pt_x), wrap_y(pt_y), static_cast<Uint32>(draw_clr) };
+    with_pixel_access(buf, job, tiled);
+}
+
+void genv::canvas::draw_line(int x, int y)
+{
+    int xdir = (x > 0 ? 1 : -1);
+    int ydir = (y > 0 ? 1 : -1);
+
+    int xstep = 0, ystep = 0;
+    int xshift = 0, yshift = 0;
+    int steps, shifts;
+
+    if (abs(x) >= abs(y))
+    {
+        xstep = xdir;
+        yshift = ydir;
+        steps = abs(x);
+        shifts = abs(y);
+    }
+    else
+    {
+        ystep = ydir;
+        xshift = xdir;
+        steps = abs(y);
+        shifts = abs(x);
+    }
+
+    touch();
+    line_job job = { buf, org_x, org_y, pt_x, pt_y, xstep, ystep, xshift, yshift, steps, shifts, static_cast<Uint32>(draw_clr) };
+    with_pixel_access(buf, job, tiled);
+    pt_x = job.x;
+    pt_y = job.y;
+}
+
+void genv::canvas::draw_box(int x, int y)
+{
+    SDL_Rect r = {pt_x, pt_y, 0, 0};
+    if (!move_point(x, y))
+        return;
+
+    if (x > 0)
+        r.w = x+1;
+    else
+    {
+        r.x += x;
+        r.w = -x+1;
+    }
+    if (y > 0)
+        r.h = y+1;
+    else
+    {
+        r.y += y;
+        r.h = -y+1;
+    }
+
+    touch();
+    SDL_Rect part[4], off[4];
+    int n = pieces(r.x, r.y, r.w, r.h, part, off);
+    fill_rects(buf, part, n, draw_clr, tiled);
+}
+
+void genv::canvas::draw_text(const std::string& str)
+{
+    draw_text(str.data(), str.length());
+}
+
+void genv::canvas::draw_text(const char* str, std::size_t len)
+{
+    touch();
+    if (font == 0 && bmfont) {
+        const bitmap_font& f = *bmfont;
+        over_paint paint = { glyph_color(buf, draw_rgb, alpha), 15 };
+        int left = pt_x;
+        const char* end = str + len;
+        while (str < end)
+        {
+            unsigned cp = next_utf8(str, end);
+            if (cp == '\n')
+            {
+                if (!move_point(left - pt_x, f.height))
+                    return;
+                continue;
+            }
+            mono_glyph g = { f.glyph(f.lookup(cp)), f.stride };
+            SDL_Rect part[4], off[4];
+            int n = pieces(pt_x, pt_y - f.ascent, f.width, f.height, part, off);
+            blit_glyph(buf, part, off, n, g, paint, tiled);
+            if (!move_point(f.width, 0))
+            {
+                pt_x = buf->w - 1;
+                return;
+            }
+        }
+    }
+    else if (font == 0) {
+        int left = pt_x;
+        over_paint paint = { glyph_color(buf, draw_rgb, alpha), 15 };
+        if (pt_y - cascent() < 0 || pt_y + cdescent() >= buf->h)
+            return;
+        for (std::size_t i=0; i<len; ++i)
+        {
+            if (str[i] == '\n')
+            {
+                if (!move_point(left - pt_x, charheight))
+                    return;
+                continue;
+            }
+            // default font not on baseline
+            nibble_glyph g = { charfaces[static_cast<unsigned char>(str[i])] };
+            SDL_Rect part[4], off[4];
+            int n = pieces(pt_x, pt_y - cascent(), charwidth, charheight, part, off);
+            blit_glyph(buf, part, off, n, g, paint, tiled);
+            if (pt_x + charwidth >= buf->w)
+            {
+                pt_x = buf->w - 1;
+                return;
+            }
+            pt_x += charwidth;
+        }
+    }
+    else if (gcache && gcache->antialias == antialiastext) { // SDL_ttf, cached glyphs
+        over_paint paint = { glyph_color(buf, draw_rgb, alpha), 255 };
+        const char* end = str + len;
+        int x = pt_x;
+        unsigned prev = 0;
+        while (str < end)
+        {
+            unsigned cp = next_utf8(str, end);
+#ifdef SDL_TTF_VERSION_ATLEAST
+#if SDL_TTF_VERSION_ATLEAST(2,0,14)
+            if (prev && prev <= 0xffff && cp <= 0xffff)
+                x += TTF_GetFontKerningSizeGlyphs(font.get(), static_cast<Uint16>(prev), static_cast<Uint16>(cp));
+#endif
+#endif
+            const glyph_cache::glyph& g = gcache->get(font.get(), cp);
+            alpha_glyph cov = { gcache->coverage(g), g.w };
+            SDL_Rect part[4], off[4];
+            int n = pieces(x + g.x, pt_y + g.y, g.w, g.h, part, off);
+            blit_glyph(buf, part, off, n, cov, paint, tiled);
+            x += g.advance;
+            prev = cp;
+        }
+        pt_x = x;
+    }
+    else { // SDL_ttf
+        // get color from draw_rgb:
+        typedef unsigned char uchar;
+        uchar r = static_cast<uchar>((draw_rgb & 0xff0000) >> 16);
+        uchar g = static_cast<uchar>((draw_rgb & 0x00ff00) >>  8);
+        uchar b = static_cast<uchar>((draw_rgb & 0x0000ff));
+        SDL_Color text_clr = {r, g, b, 0xFF};
+        // SDL_ttf needs a terminated string, short ones are copied on the stack
+        char local[256];
+        std::string heap;
+        const char* cstr = local;
+        if (len < sizeof(local)) {
+            std::memcpy(local, str, len);
+            local[len] = 0;
+        } else {
+            heap.assign(str, len);
+            cstr = heap.c_str();
+        }
+        SDL_Surface* t = nullptr;
+        // render text in blended mode (AA)
+        if (antialiastext) {
+            t = TTF_RenderUTF8_Blended(font.get(), cstr, text_clr);
+        } else {
+            t = TTF_RenderUTF8_Solid(font.get(), cstr, text_clr);
+        }
+        if (t == nullptr) // empty string or rendering error
+            return;
+        SDL_Rect part[4], off[4];
+        int n = pieces(pt_x, pt_y, t->w, t->h, part, off);
+        pt_x += t->w;
+        if (buf->format->BitsPerPixel < 8) {
+            // SDL cannot blit into 1 bit: the pixels covered at least half
+            SDL_LockSurface(t);
+            for (int i=0; i<n; ++i)
+                for (int row=0; row<part[i].h; ++row)
+                    for (int col=0; col<part[i].w; ++col)
+                    {
+                        Uint32 v = read_pixel(t, off[i].x + col, off[i].y + row);
+                        Uint8 r, g, b, a = v ? 0xff : 0;
+                        if (t->format->BytesPerPixel != 1)
+                            SDL_GetRGBA(v, t->format, &r, &g, &b, &a);
+                        if (a >= 128)
+                            write_pixel(buf, part[i].x + col, part[i].y + row, draw_clr);
+                    }
+            SDL_UnlockSurface(t);
+        } else if (buf->format->palette) {
+            // SDL would map onto the palette through 3-3-2 colors: the text
+            // as an alpha canvas, blended in rows as blit_part() does
+            canvas tmp;
+            tmp.buf = convert_surface(t, SDL_PIXELFORMAT_ARGB8888);
+            if (tmp.buf) {
+                premultiply(tmp.buf);
+                tmp.alpha = true;
+                for (int i=0; i<n; ++i)
+                    blit_part(tmp, off[i].x, off[i].y, part[i].w, part[i].h, part[i].x, part[i].y, blend_normal);
+            }
+        } else {
+            for (int i=0; i<n; ++i) {
+                SDL_Rect src = { off[i].x, off[i].y, part[i].w, part[i].h };
+                if (!tiled) {
+                    SDL_BlitSurface( t, &src, buf, &part[i] );
+                    continue;
+                }
+                // onto tiles through a copy of the covered rows
+                SDL_Surface* rows = create_like(buf, part[i].w, part[i].h);
+                if (rows == 0)
+                    continue;
+                for (int row=0; row<part[i].h; ++row)
+                    tiled_read(buf, part[i].x, part[i].y + row, part[i].w, pixel_row(rows, row));
+                SDL_BlitSurface( t, &src, rows, 0 );
+                for (int row=0; row<part[i].h; ++row)
+                    tiled_write(buf, part[i].x, part[i].y + row, part[i].w, pixel_row(rows, row));
+                free_surface(rows);
+            }
+        }
+        //std::cout << "DIMENSIONS: " << t->w << "," << t->h << std::endl;
+        SDL_FreeSurface(t);
+    }
+}
+
+void genv::canvas::blitfrom(const genv::canvas &c, int x1, int y1, int x2, int y2, int x3, int y3, blend_mode mode) {
+    touch();
+    if (x1==-1) x1=0;
+    if (y1==-1) y1=0;
+    if (x2==-1) x2=c.buf->w;
+    if (y2==-1) y2=c.buf->h;
+    int sx = x1, sy = y1, w = x2, h = y2, tx = x3, ty = y3;
+    if (!clip_blit(sx, sy, w, h, tx, ty, c.buf->w, c.buf->h, buf->w, buf->h))
+        return;
+    // overlapping: a self-blit, e.g. scrolling the screen, or between a
+    // view and its parent
+    if (shares_pixels(c)) {
+        if (&c == this && !transp && !alpha && mode == blend_normal) {
+            move_area(sx, sy, w, h, tx, ty);
+        } else {
+            canvas tmp;
+            tmp.buf = create_like(c.buf, w, h);
+            if (tmp.buf == 0)
+                return;
+            c.copy_out(sx, sy, w, h, static_cast<unsigned char*>(tmp.buf->pixels), tmp.buf->pitch);
+            tmp.transp = c.transp;
+            tmp.alpha = c.alpha;
+            tmp.compact = c.compact;
+            tmp.palette = c.palette;
+            blitfrom(tmp, 0, 0, w, h, tx, ty, mode);
+        }
+        return;
+    }
+    // the parts of the target, and the parts of the source for each
+    SDL_Rect tpart[4], toff[4], spart[4], soff[4];
+    int nt = pieces(tx, ty, w, h, tpart, toff);
+    for (int i=0; i<nt; ++i)
+    {
+        int ns = c.pieces(sx + toff[i].x, sy + toff[i].y, tpart[i].w, tpart[i].h, spart, soff);
+        for (int j=0; j<ns; ++j)
+            blit_part(c, spart[j].x, spart[j].y, spart[j].w, spart[j].h,
+                      tpart[i].x + soff[j].x, tpart[i].y + soff[j].y, mode);
+    }
+}
+
+bool genv::canvas::shares_pixels(const canvas& c) const
+{
+    const canvas* a = this;
+    const canvas* b = &c;
+    while (a->owner)
+        a = a->owner;
+    while (b->owner)
+        b = b->owner;
+    return a == b;
+}
+
+namespace
+{
+    // a batch_item clipped to both canvases
+    struct batch_job
+    {
+        int sx, sy, w, h, tx, ty;
+        int flip;
+        int tint;
+    };
+
+    // Cuts the part of a mirrored or plain span [s, s+len) -> [t, t+len)
+    // outside [0, slim) of the source and [0, tlim) of the target.
+    bool clip_flipped(int& s, int& t, int& len, bool flip, int slim, int tlim)
+    {
+        int cut;
+        if ((cut = -s) > 0) { len -= cut; s = 0; if (!flip) t += cut; }
+        if ((cut = s + len - slim) > 0) { len -= cut; if (flip) t += cut; }
+        if ((cut = -t) > 0) { len -= cut; t = 0; if (!flip) s += cut; }
+        if ((cut = t + len - tlim) > 0) { len -= cut; if (flip) s += cut; }
+        return len > 0;
+    }
+
+    bool by_target(const batch_job& a, const batch_job& b)
+    {
+        return a.ty != b.ty ? a.ty < b.ty : a.tx < b.tx;
+    }
+}
+
+void genv::canvas::blit_batch(const canvas& sheet, const batch_item* items, std::size_t n, bool sort_by_target)
+{
+    if (n == 0 || buf == 0 || sheet.buf == 0)
+        return;
+    const SDL_PixelFormat* sf = sheet.buf->format;
+    const SDL_PixelFormat* df = buf->format;
+    bool direct = sf->BytesPerPixel == 4 && df->BytesPerPixel == 4 && (df->Rmask | df->Gmask | df->Bmask) == 0x00ffffff &&
+                  sf->Rmask == df->Rmask && sf->Gmask == df->Gmask && sf->Bmask == df->Bmask &&
+                  (!sheet.alpha || sf->Amask == 0xff000000) &&
+                  !ring && !sheet.ring && !tiled && !sheet.tiled && !shares_pixels(sheet);
+    if (!direct) {
+        // one by one through the general blits, mirrored and tinted copies
+        // of the regions that need it
+        int rgb = draw_rgb;
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            const batch_item& e = items[i];
+            // clipped to the sheet, as -1 would mean "all" to blitfrom
+            int sx = e.sx, sy = e.sy, w = e.w, h = e.h, tx = 0, ty = 0;
+            if (!clip_flipped(sx, tx, w, (e.flip & flip_x) != 0, sheet.buf->w, w) ||
+                !clip_flipped(sy, ty, h, (e.flip & flip_y) != 0, sheet.buf->h, h))
+                continue;
+            if (e.flip == flip_none && e.tint < 0) {
+                blitfrom(sheet, sx, sy, w, h, e.x + tx, e.y + ty);
+                continue;
+            }
+            canvas tmp;
+            tmp.buf = create_like(sheet.buf, w, h);
+            if (tmp.buf == 0)
+                continue;
+            tmp.transp = sheet.transp;
+            tmp.alpha = sheet.alpha;
+            tmp.compact = sheet.compact;
+            tmp.palette = sheet.palette;
+            int bpp = sf->BytesPerPixel;
+            std::vector<unsigned char> line(static_cast<std::size_t>(w) * bpp);
+            for (int y = 0; y < h && sf->BitsPerPixel < 8; ++y)
+                for (int x = 0; x < w; ++x)
+                    write_pixel(tmp.buf, (e.flip & flip_x) ? w - 1 - x : x, (e.flip & flip_y) ? h - 1 - y : y,
+                                read_pixel(sheet.buf, sheet.wrap_x(sx + x), sheet.wrap_y(sy + y)));
+            for (int y = 0; y < h && sf->BitsPerPixel >= 8; ++y)
+            {
+                unsigned char* out = static_cast<unsigned char*>(tmp.buf->pixels) + ((e.flip & flip_y) ? h - 1 - y : y) * tmp.buf->pitch;
+                sheet.copy_out(sx, sy + y, w, 1, (e.flip & flip_x) ? &line[0] : out, w * bpp);
+                if (e.flip & flip_x)
+                    for (int x = 0; x < w; ++x)
+                        std::memcpy(out + (w - 1 - x) * bpp, &line[x * bpp], bpp);
+            }
+            if (e.tint >= 0)
+                set_color((e.tint >> 16) & 0xff, (e.tint >> 8) & 0xff, e.tint & 0xff);
+            blitfrom(tmp, 0, 0, w, h, e.x + tx, e.y + ty, e.tint >= 0 ? blend_tint : blend_normal);
+        }
+        draw_rgb = rgb;
+        draw_clr = map_rgb(buf, draw_rgb, alpha);
+        return;
+    }
+    touch();
+
+    // clip all of them first
+    std::vector<batch_job> jobs;
+    jobs.reserve(n);
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        const batch_item& e = items[i];
+        batch_job j = { e.sx, e.sy, e.w, e.h, e.x, e.y, e.flip, e.tint };
+        if (clip_flipped(j.sx, j.tx, j.w, (j.flip & flip_x) != 0, sheet.buf->w, buf->w) &&
+            clip_flipped(j.sy, j.ty, j.h, (j.flip & flip_y) != 0, sheet.buf->h, buf->h))
+            jobs.push_back(j);
+    }
+    if (sort_by_target)
+        std::stable_sort(jobs.begin(), jobs.end(), by_target);
+
+    int kind = sheet.alpha ? alpha_source : sheet.transp ? keyed_source : opaque_source;
+    blend_row_fn over = blend_row<over_op>, tinted = blend_row<tint_op>;
+    std::vector<Uint32> mirrored;
+    for (std::size_t i = 0; i < jobs.size(); ++i)
+    {
+        const batch_job& j = jobs[i];
+        Uint32 tint = j.tint < 0 ? 0 : map_rgb(buf, j.tint) | 0xff000000;
+        if (j.flip & flip_x)
+            mirrored.resize(j.w);
+        for (int y = 0; y < j.h; ++y)
+        {
+            const Uint32* src = &pixel(sheet.buf, j.sx, (j.flip & flip_y) ? j.sy + j.h - 1 - y : j.sy + y);
+            Uint32* dst = &pixel(buf, j.tx, j.ty + y);
+            if (j.flip & flip_x) {
+                std::reverse_copy(src, src + j.w, mirrored.begin());
+                src = &mirrored[0];
+            }
+            if (j.tint >= 0)
+                tinted(dst, src, j.w, kind, tint);
+            else if (kind == opaque_source)
+                std::memcpy(dst, src, j.w * sizeof(Uint32));
+            else
+                over(dst, src, j.w, kind, 0);
+        }
+    }
+}
+
+genv::canvas_view::canvas_view(canvas& parent, int x, int y, int w, int h)
+{
+    attach(parent, x, y, w, h);
+}
+
+genv::canvas_view::canvas_view(const canvas_view& v) : canvas(), vx(0), vy(0)
+{
+    if (v.owner)    // not moved from
+        attach(*v.owner, v.vx, v.vy, v.width(), v.height());
+}
+
+genv::canvas_view& genv::canvas_view::operator=(const canvas_view& v)
+{
+    if (this == &v)
+        return *this;
+    if (v.owner) {
+        attach(*v.owner, v.vx, v.vy, v.width(), v.height());
+    } else {
+        free_surface(buf);
+        buf = 0;
+        owner = 0;
+        vx = vy = 0;
+    }
+    return *this;
+}
+
+void genv::canvas_view::attach(canvas& parent, int x, int y, int w, int h)
+{
+    free_surface(buf);
+    buf = 0;
+    drop_derived();
+    owner = &parent;
+    if (parent.buf == 0) {
+        // of an unopened canvas: without pixels, like that
+        vx = vy = 0;
+        return;
+    }
+    // the parent keeps its pixels where they are from now on
+    if (parent.shared)
+        parent.unshare();
+    parent.pinned = true;
+    if (parent.tiled) {
+        retile(parent.buf, false);
+        parent.tiled = false;
+    }
+    int x0 = std::max(x, 0), y0 = std::max(y, 0);
+    SDL_Surface* p = parent.buf;
+    bool bits = p->format->BitsPerPixel < 8;
+    if (bits)
+        x0 &= ~7;   // rows start at a whole byte
+    w = std::max(0, std::min(x + w, p->w) - x0);
+    h = std::max(0, std::min(y + h, p->h) - y0);
+    // a surface over the parent's memory, with its pitch
+    Uint8* px = static_cast<Uint8*>(p->pixels) + (w && h ? y0 * p->pitch + (bits ? x0 / 8 : x0 * p->format->BytesPerPixel) : 0);
+    buf = SDL_CreateRGBSurfaceWithFormatFrom(px, w, h, p->format->BitsPerPixel, p->pitch, p->format->format);
+    if (buf) {
+        SDL_SetSurfaceBlendMode(buf, SDL_BLENDMODE_NONE);
+        copy_palette(p, buf);
+    }
+    vx = x0;
+    vy = y0;
+    transp = parent.transp;
+    alpha = parent.alpha;
+    compact = parent.compact;
+    palette = parent.palette;
+    bmfont = parent.bmfont;
+    draw_clr = buf ? map_rgb(buf, draw_rgb, alpha) : draw_rgb;
+    pt_x = w/2;
+    pt_y = h/2;
+}
+
+// The file of a mapped_canvas: a header page, then the tiles row by row of
+// tiles, each one tile_side x tile_side pixels stored row by row. The tiles
+// at the right and bottom edge are stored whole too.
+class genv::tile_store
+{
+public:
+    bool create(const char* fname, int w, int h, Uint32 format);
+    bool open(const char* fname);
+    // copies a rectangle of the image between s (of the same pixel format)
+    // and the tiles it covers
+    void copy(SDL_Surface* s, int x, int y, bool to_tiles);
+    unsigned char* tile(int tx, int ty)
+    { return file.data + tile_data + (static_cast<std::size_t>(ty) * cols + tx) * tile_bytes; }
+
+    static const int tile_side = 256;
+    static const std::size_t tile_data = 4096;
+    int w, h, cols, rows;
+    Uint32 format;
+    int bpp, pitch;
+    std::size_t tile_bytes;
+    mapped_file file;
+
+private:
+    void layout(int w_, int h_, Uint32 format_);
+    bool file_size(std::size_t& n) const;
+};
+
+namespace
+{
+    const char tile_magic[8] = { 'G','E','N','V','T','I','L','E' };
+    const Uint32 tile_version = 1;
+
+    struct tile_header
+    {
+        char magic[8];
+        Uint32 version;
+        Uint32 format;
+        Uint32 width, height;
+        Uint32 tile_side;
+    };
+}
+
+void genv::tile_store::layout(int w_, int h_, Uint32 format_)
+{
+    w = w_;
+    h = h_;
+    format = format_;
+    cols = (w + tile_side - 1) / tile_side;
+    rows = (h + tile_side - 1) / tile_side;
+    bpp = SDL_BYTESPERPIXEL(format);
+    pitch = tile_side * bpp;
+    tile_bytes = static_cast<std::size_t>(pitch) * tile_side;
+}
+
+// bytes of the file, false when they do not fit in a size_t (32 bit systems)
+bool genv::tile_store::file_size(std::size_t& n) const
+{
+    const std::size_t most = static_cast<std::size_t>(-1);
+    if (static_cast<std::size_t>(rows) > (most - tile_data) / tile_bytes / static_cast<std::size_t>(cols))
+        return false;
+    n = tile_data + static_cast<std::size_t>(cols) * rows * tile_bytes;
+    return true;
+}
+
+bool genv::tile_store::create(const char* fname, int w_, int h_, Uint32 format_)
+{
+    if (w_ <= 0 || h_ <= 0 || w_ > INT_MAX - tile_side || h_ > INT_MAX - tile_side || SDL_BYTESPERPIXEL(format_) == 0)
+        return false;
+    layout(w_, h_, format_);
+    std::size_t n;
+    if (!file_size(n) || !file.open_rw(fname, n))
+        return false;
+    tile_header hdr;
+    std::memcpy(hdr.magic, tile_magic, sizeof(tile_magic));
+    hdr.version = tile_version;
+    hdr.format = format;
+    hdr.width = w;
+    hdr.height = h;
+    hdr.tile_side = tile_side;
+    std::memcpy(file.data, &hdr, sizeof(hdr));
+    return true;
+}
+
+bool genv::tile_store::open(const char* fname)
+{
+    if (!file.open_rw(fname) || file.size < sizeof(tile_header))
+        return false;
+    tile_header hdr;
+    std::memcpy(&hdr, file.data, sizeof(hdr));
+    if (std::memcmp(hdr.magic, tile_magic, sizeof(tile_magic)) != 0 || hdr.version != tile_version ||
+        hdr.tile_side != static_cast<Uint32>(tile_side) || hdr.width == 0 || hdr.height == 0 ||
+        hdr.width > static_cast<Uint32>(INT_MAX - tile_side) || hdr.height > static_cast<Uint32>(INT_MAX - tile_side) ||
+        SDL_BYTESPERPIXEL(hdr.format) == 0)
+        return false;
+    layout(static_cast<int>(hdr.width), static_cast<int>(hdr.height), hdr.format);
+    std::size_t n;
+    return file_size(n) && file.size >= n;
+}
+
+void genv::tile_store::copy(SDL_Surface* s, int x, int y, bool to_tiles)
+{
+    // clipped to the image: the viewport may have been replaced through a
+    // canvas& by a surface of another size (or format, then nothing is copied)
+    int sw = std::min(s->w, w - x), sh = std::min(s->h, h - y);
+    if (sw <= 0 || sh <= 0 || x < 0 || y < 0 || s->format->format != format)
+        return;
+    for (int ty = y / tile_side; ty <= (y + sh - 1) / tile_side; ++ty)
+        for (int tx = x / tile_side; tx <= (x + sw - 1) / tile_side; ++tx)
+        {
+            int x0 = std::max(x, tx * tile_side), x1 = std::min(x + sw, (tx + 1) * tile_side);
+            int y0 = std::max(y, ty * tile_side), y1 = std::min(y + sh, (ty + 1) * tile_side);
+            std::size_t n = static_cast<std::size_t>(x1 - x0) * bpp;
+            unsigned char* t = tile(tx, ty) + (x0 - tx * tile_side) * bpp;
+            unsigned char* p = static_cast<unsigned char*>(s->pixels) + (x0 - x) * bpp;
+            for (int row = y0; row < y1; ++row)
+            {
+                unsigned char* tr = t + (row - ty * tile_side) * pitch;
+                unsigned char* pr = p + (row - y) * s->pitch;
+                if (to_tiles)
+                    std::memcpy(tr, pr, n);
+                else
+                    std::memcpy(pr, tr, n);
+            }
+        }
+}
+
+genv::mapped_canvas::mapped_canvas(const std::string& file) :
+    store(std::make_shared<tile_store>()), vx(0), vy(0), direct(false), synced(0)
+{
+    pinned = true;
+    if (!store->open(file.c_str())) {
+        store.reset();
+        return;
+    }
+    view(0, 0, tile_store::tile_side, tile_store::tile_side);
+}
+
+genv::mapped_canvas::mapped_canvas(const std::string& file, int w, int h) :
+    store(std::make_shared<tile_store>()), vx(0), vy(0), direct(false), synced(0)
+{
+    pinned = true;
+    if (!store->create(file.c_str(), w, h, own_format())) {
+        store.reset();
+        return;
+    }
+    view(0, 0, tile_store::tile_side, tile_store::tile_side);
+}
+
+genv::mapped_canvas::~mapped_canvas()
+{
+    write_back();
+    free_surface(buf);
+    buf = 0;
+}
+
+int genv::mapped_canvas::full_width() const
+{
+    return store ? store->w : 0;
+}
+
+int genv::mapped_canvas::full_height() const
+{
+    return store ? store->h : 0;
+}
+
+void genv::mapped_canvas::write_back()
+{
+    if (store && buf && !direct && changes != synced)
+        store->copy(buf, vx, vy, true);
+    synced = changes;
+}
+
+void genv::mapped_canvas::sync()
+{
+    write_back();
+    if (store)
+        store->file.flush();
+}
+
+void genv::mapped_canvas::view(int x, int y, int w, int h)
+{
+    if (!store)
+        return;
+    write_back();
+    drop_derived();
+    free_surface(buf);
+    buf = 0;
+    const int side = tile_store::tile_side;
+    int x0 = std::max(x, 0), y0 = std::max(y, 0);
+    w = static_cast<int>(std::max(0LL, std::min(static_cast<long long>(x) + w, static_cast<long long>(store->w)) - x0));
+    h = static_cast<int>(std::max(0LL, std::min(static_cast<long long>(y) + h, static_cast<long long>(store->h)) - y0));
+    if (w == 0 || h == 0)
+        x0 = y0 = 0;
+    // inside one tile: a surface over the mapped tile, like canvas_view
+    direct = w == 0 || h == 0 || (x0 / side == (x0 + w - 1) / side && y0 / side == (y0 + h - 1) / side);
+    if (direct) {
+        unsigned char* px = store->tile(x0 / side, y0 / side) + (y0 % side) * store->pitch + (x0 % side) * store->bpp;
+        buf = SDL_CreateRGBSurfaceWithFormatFrom(px, w, h, SDL_BITSPERPIXEL(store->format), store->pitch, store->format);
+        if (buf)
+            SDL_SetSurfaceBlendMode(buf, SDL_BLENDMODE_NONE);
+    } else {
+        buf = create_surface(w, h, store->format);
+        if (buf)
+            store->copy(buf, x0, y0, false);
+    }
+    vx = x0;
+    vy = y0;
+    ++changes;
+    synced = changes;
+    draw_clr = buf ? map_rgb(buf, draw_rgb, alpha) : draw_rgb;
+    pt_x = w/2;
+    pt_y = h/2;
+}
+
+genv::compositor::compositor(canvas& target) : out(target)
+{
+}
+
+int genv::compositor::add_layer(int w, int h, int x, int y, bool with_alpha)
+{
+    layer_state l;
+    l.c.reset(with_alpha ? new alpha_canvas(w, h) : new canvas(w, h));
+    l.x = x;
+    l.y = y;
+    l.visible = true;
+    l.marked = false;
+    l.seen = l.c->changes;
+    layers.push_back(l);
+    damage(x, y, w, h);
+    return static_cast<int>(layers.size()) - 1;
+}
+
+void genv::compositor::move_layer(int i, int x, int y)
+{
+    layer_state& l = layers[i];
+    if (l.x == x && l.y == y)
+        return;
+    if (l.visible) {
+        damage(l.x, l.y, l.c->width(), l.c->height());
+        damage(x, y, l.c->width(), l.c->height());
+    }
+    l.x = x;
+    l.y = y;
+}
+
+void genv::compositor::show_layer(int i, bool visible)
+{
+    layer_state& l = layers[i];
+    if (l.visible != visible)
+        damage(l.x, l.y, l.c->width(), l.c->height());
+    l.visible = visible;
+}
+
+void genv::compositor::invalidate(int i, int x, int y, int w, int h)
+{
+    layer_state& l = layers[i];
+    l.marked = true;
+    if (l.visible)
+        damage(l.x + x, l.y + y, w, h);
+}
+
+void genv::compositor::invalidate_all()
+{
+    damage(0, 0, out.width(), out.height());
+}
+
+void genv::compositor::damage(int x, int y, int w, int h)
+{
+    if (!clip_rect(x, y, w, h, out.width(), out.height()))
+        return;
+    area a = { x, y, w, h };
+    // merge with everything it overlaps or touches, again with the result
+    for (std::size_t i = 0; i < dirty.size(); )
+    {
+        const area& d = dirty[i];
+        if (a.x <= d.x + d.w && d.x <= a.x + a.w && a.y <= d.y + d.h && d.y <= a.y + a.h) {
+            int x1 = std::max(a.x + a.w, d.x + d.w), y1 = std::max(a.y + a.h, d.y + d.h);
+            a.x = std::min(a.x, d.x);
+            a.y = std::min(a.y, d.y);
+            a.w = x1 - a.x;
+            a.h = y1 - a.y;
+            dirty.erase(dirty.begin() + i);
+            i = 0;
+        } else {
+            ++i;
+        }
+    }
+    dirty.push_back(a);
+}
+
+void genv::compositor::compose(const area& a)
+{
+    // from the topmost opaque layer that hides all below
+    std::size_t first = 0;
+    bool covered = false;
+    for (std::size_t i = layers.size(); i-- > 0; )
+    {
+        const layer_state& l = layers[i];
+        if (l.visible && !l.c->transp && !l.c->alpha && l.x <= a.x && l.y <= a.y &&
+            l.x + l.c->width() >= a.x + a.w && l.y + l.c->height() >= a.y + a.h) {
+            first = i;
+            covered = true;
+            break;
+        }
+    }
+    if (!covered) {
+        out.touch();
+        SDL_Rect part[4], off[4];
+        int n = out.pieces(a.x, a.y, a.w, a.h, part, off);
+        fill_rects(out.buf, part, n, map_rgb(out.buf, 0), out.tiled);
+    }
+    for (std::size_t i = first; i < layers.size(); ++i)
+    {
+        const layer_state& l = layers[i];
+        int x0 = std::max(a.x, l.x), y0 = std::max(a.y, l.y);
+        int x1 = std::min(a.x + a.w, l.x + l.c->width()), y1 = std::min(a.y + a.h, l.y + l.c->height());
+        if (l.visible && x0 < x1 && y0 < y1)
+            out.blitfrom(*l.c, x0 - l.x, y0 - l.y, x1 - x0, y1 - y0, x0, y0);
+    }
+}
+
+void genv::compositor::refresh()
+{
+    for (std::size_t i = 0; i < layers.size(); ++i)
+    {
+        layer_state& l = layers[i];
+        if (l.c->changes != l.seen && !l.marked && l.visible)
+            damage(l.x, l.y, l.c->width(), l.c->height());
+        l.seen = l.c->changes;
+        l.marked = false;
+    }
+    for (std::size_t i = 0; i < dirty.size(); ++i)
+        compose(dirty[i]);
+    dirty.clear();
+    out.refresh();
+}
+
+genv::atlas::atlas(int w, int h, bool with_alpha)
+    : sheet_(with_alpha ? new alpha_canvas(w, h) : new canvas(w, h)), used(0)
+{
+    skyline_segment s = { 0, 0, w };
+    skyline.push_back(s);
+}
+
+genv::atlas_region genv::atlas::add(const canvas& c)
+{
+    atlas_region r;
+    int w = c.width(), h = c.height(), sw = sheet_->width(), sh = sheet_->height();
+    if (w <= 0 || h <= 0)
+        return r;
+    // bottom-left skyline: the lowest top among the places wide enough,
+    // then the leftmost
+    int best = -1, best_y = 0, best_top = sh + 1;
+    for (std::size_t i = 0; i < skyline.size(); ++i)
+    {
+        int x = skyline[i].x;
+        if (x + w > sw)
+            break;
+        int y = 0;
+        for (std::size_t j = i; j < skyline.size() && skyline[j].x < x + w; ++j)
+            y = std::max(y, skyline[j].y);
+        if (y + h <= sh && y + h < best_top) {
+            best = static_cast<int>(i);
+            best_y = y;
+            best_top = y + h;
+        }
+    }
+    if (best < 0)
+        return r;
+    r.sheet = sheet_.get();
+    r.x = skyline[best].x;
+    r.y = best_y;
+    r.w = w;
+    r.h = h;
+
+    // the new segment replaces what it covers, the last one partly
+    skyline_segment s = { r.x, best_y + h, w };
+    std::size_t end = best;
+    while (end < skyline.size() && skyline[end].x + skyline[end].w <= r.x + w)
+        ++end;
+    if (end < skyline.size() && skyline[end].x < r.x + w) {
+        skyline[end].w -= r.x + w - skyline[end].x;
+        skyline[end].x = r.x + w;
+    }
+    skyline.erase(skyline.begin() + best, skyline.begin() + end);
+    skyline.insert(skyline.begin() + best, s);
+    for (std::size_t i = 0; i + 1 < skyline.size(); )
+        if (skyline[i].y == skyline[i + 1].y) {
+            skyline[i].w += skyline[i + 1].w;
+            skyline.erase(skyline.begin() + i + 1);
+        } else {
+            ++i;
+        }
+
+    sheet_->blitfrom(c, 0, 0, w, h, r.x, r.y);
+    used += static_cast<long long>(w) * h;
+    return r;
+}
+
+double genv::atlas::usage() const
+{
+    long long all = static_cast<long long>(sheet_->width()) * sheet_->height();
+    return all ? static_cast<double>(used) / all : 0;
+}
+
+genv::accumulator::accumulator(int w_, int h_)
+    : w(std::max(w_, 0)), h(std::max(h_, 0)), sums(static_cast<std::size_t>(w) * h * 4)
+{
+    set_color(255, 255, 255);
+    set_tonemap(tonemap_clamp);
+}
+
+void genv::accumulator::clear()
+{
+    std::fill(sums.begin(), sums.end(), 0);
+}
+
+void genv::accumulator::fade(double f)
+{
+    if (f >= 1 || sums.empty())
+        return;
+    // s * m / 65536, rounded down
+    int m = static_cast<int>(std::max(f, 0.0) * 65536);
+    Uint16* p = &sums[0];
+    std::size_t n = sums.size(), i = 0;
+#if GENV_SIMD
+    const __m128i mul = _mm_set1_epi16(static_cast<short>(m));
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i* q = reinterpret_cast<__m128i*>(p + i);
+        _mm_storeu_si128(q, _mm_mulhi_epu16(_mm_loadu_si128(q), mul));
+    }
+#endif
+    for (; i < n; ++i)
+        p[i] = static_cast<Uint16>((p[i] * static_cast<unsigned>(m)) >> 16);
+}
+
+void genv::accumulator::set_color(int r, int g, int b)
+{
+    dot[0] = static_cast<Uint16>(std::min(std::max(b, 0), 65535));
+    dot[1] = static_cast<Uint16>(std::min(std::max(g, 0), 65535));
+    dot[2] = static_cast<Uint16>(std::min(std::max(r, 0), 65535));
+    dot[3] = 0;
+}
+
+void genv::accumulator::add_dot(int x, int y)
+{
+    add_dots(&x, &y, 1);
+}
+
+void genv::accumulator::add_dots(const int* xs, const int* ys, std::size_t n)
+{
+    Uint16* p = sums.empty() ? 0 : &sums[0];
+#if GENV_SIMD
+    const __m128i d = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(dot));
+#endif
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        // one unsigned compare for both ends
+        if (static_cast<unsigned>(xs[i]) >= static_cast<unsigned>(w) ||
+            static_cast<unsigned>(ys[i]) >= static_cast<unsigned>(h))
+            continue;
+        Uint16* s = p + (static_cast<std::size_t>(ys[i]) * w + xs[i]) * 4;
+#if GENV_SIMD
+        __m128i* q = reinterpret_cast<__m128i*>(s);
+        _mm_storel_epi64(q, _mm_adds_epu16(_mm_loadl_epi64(q), d));
+#else
+        for (int c = 0; c < 3; ++c)
+            s[c] = static_cast<Uint16>(std::min(65535, s[c] + dot[c]));
+#endif
+    }
+}
+
+void genv::accumulator::add(const canvas& c, int x, int y, int weight)
+{
+    if (c.buf == 0 || weight <= 0)
+        return;
+    weight = std::min(weight, 255);
+    int sx = 0, sy = 0, cw = c.buf->w, ch = c.buf->h;
+    if (!clip_blit(sx, sy, cw, ch, x, y, c.buf->w, c.buf->h, w, h))
+        return;
+    const SDL_PixelFormat* sf = c.buf->format;
+    // rows of the source with blue, green, red in the low bytes, as the sums
+    bool direct = sf->BytesPerPixel == 4 && sf->Rmask == 0x00ff0000 && sf->Gmask == 0x0000ff00 && sf->Bmask == 0x000000ff;
+    std::vector<Uint32> line(cw);
+    for (int row = 0; row < ch; ++row)
+    {
+        const Uint32* src;
+        if (direct && !c.ring && !c.tiled) {
+            src = &pixel(c.buf, sx, sy + row);
+        } else if (direct) {
+            c.copy_out(sx, sy + row, cw, 1, reinterpret_cast<unsigned char*>(&line[0]), cw * 4);
+            src = &line[0];
+        } else {
+            Uint8 r, g, b;
+            for (int i = 0; i < cw; ++i)
+            {
+                SDL_GetRGB(c.value_at(sx + i, sy + row), sf, &r, &g, &b);
+                line[i] = static_cast<Uint32>(r) << 16 | g << 8 | b;
+            }
+            src = &line[0];
+        }
+        Uint16* dst = &sums[(static_cast<std::size_t>(y + row) * w + x) * 4];
+        int i = 0;
+#if GENV_SIMD
+        const __m128i zero = _mm_setzero_si128(), rgb = _mm_set1_epi32(0x00ffffff);
+        const __m128i wt = _mm_set1_epi16(static_cast<short>(weight)), half = _mm_set1_epi16(128);
+        for (; i + 4 <= cw; i += 4)
+        {
+            __m128i s = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)), rgb);
+            __m128i lo = _mm_unpacklo_epi8(s, zero), hi = _mm_unpackhi_epi8(s, zero);
+            if (weight < 255) {
+                // div255 of the products, as v_div255
+                lo = _mm_add_epi16(_mm_mullo_epi16(lo, wt), half);
+                lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+                hi = _mm_add_epi16(_mm_mullo_epi16(hi, wt), half);
+                hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+            }
+            __m128i* q = reinterpret_cast<__m128i*>(dst + 4 * i);
+            _mm_storeu_si128(q, _mm_adds_epu16(_mm_loadu_si128(q), lo));
+            _mm_storeu_si128(q + 1, _mm_adds_epu16(_mm_loadu_si128(q + 1), hi));
+        }
+#endif
+        for (; i < cw; ++i)
+            for (int k = 0; k < 3; ++k)
+            {
+                int v = (src[i] >> (8 * k)) & 0xff;
+                if (weight < 255)
+                    v = div255(v * weight);
+                Uint16& s = dst[4 * i + k];
+                s = static_cast<Uint16>(std::min(65535, s + v));
+            }
+    }
+}
+
+void genv::accumulator::set_tonemap(tonemap_t t, double e)
+{
+    tonemap = t;
+    exposure = e;
+    curve.resize(65536);
+    for (int v = 0; v < 65536; ++v)
+    {
+        double x = v * e / 255, y;
+        if (t == tonemap_reinhard)
+            y = x / (1 + x);
+        else if (t == tonemap_exponential)
+            y = 1 - std::exp(-x);
+        else
+            y = x;
+        curve[v] = static_cast<unsigned char>(std::min(std::max(y * 255 + 0.5, 0.0), 255.0));
+    }
+}
+
+void genv::accumulator::resolve(canvas& out, int x, int y, blend_mode mode) const
+{
+    int sx = 0, sy = 0, cw = w, ch = h;
+    if (out.buf == 0 || !clip_blit(sx, sy, cw, ch, x, y, w, h, out.buf->w, out.buf->h))
+        return;
+    const SDL_PixelFormat* df = out.buf->format;
+    bool direct = df->BytesPerPixel == 4 && df->Rmask == 0x00ff0000 && df->Gmask == 0x0000ff00 && df->Bmask == 0x000000ff;
+    // other targets get the result through a canvas of ARGB8888
+    canvas tmp;
+    if (!direct) {
+        tmp.buf = create_surface(cw, ch, SDL_PIXELFORMAT_ARGB8888);
+        if (tmp.buf == 0)
+            return;
+    } else {
+        out.touch();
+    }
+    blend_row_fn blend = blend_kernel(mode);
+    Uint32 tint = static_cast<Uint32>(out.draw_rgb) | 0xff000000;
+    // a plain clamp needs no table
+    bool clamp = tonemap == tonemap_clamp && exposure == 1;
+    std::vector<Uint32> line(cw);
+    for (int row = 0; row < ch; ++row)
+    {
+        const Uint16* s = &sums[(static_cast<std::size_t>(sy + row) * w + sx) * 4];
+        Uint32* colors = direct ? &line[0] : &pixel(tmp.buf, 0, row);
+        int i = 0;
+#if GENV_SIMD
+        if (clamp) {
+            // min(s, 255) by saturating up and back, then to bytes
+            const __m128i top = _mm_set1_epi16(static_cast<short>(0xff00)), opaque = _mm_set1_epi32(static_cast<int>(0xff000000));
+            for (; i + 4 <= cw; i += 4)
+            {
+                __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 4 * i));
+                __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 4 * i + 8));
+                lo = _mm_subs_epu16(_mm_adds_epu16(lo, top), top);
+                hi = _mm_subs_epu16(_mm_adds_epu16(hi, top), top);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(colors + i), _mm_or_si128(_mm_packus_epi16(lo, hi), opaque));
+            }
+        }
+#endif
+        for (; i < cw; ++i)
+        {
+            const Uint16* p = s + 4 * i;
+            if (clamp)
+                colors[i] = 0xff000000 | std::min<Uint32>(p[2], 255) << 16 | std::min<Uint32>(p[1], 255) << 8 | std::min<Uint32>(p[0], 255);
+            else
+                colors[i] = 0xff000000 | static_cast<Uint32>(curve[p[2]]) << 16 | curve[p[1]] << 8 | curve[p[0]];
+        }
+        if (direct) {
+            SDL_Rect part[4], off[4];
+            int n = out.pieces(x, y + row, cw, 1, part, off);
+            for (int k = 0; k < n; ++k)
+                if (out.tiled)
+                    blend_tiled(blend, out.buf, part[k].x, part[k].y, &line[off[k].x], part[k].w, opaque_source, tint);
+                else
+                    blend(&pixel(out.buf, part[k].x, part[k].y), &line[off[k].x], part[k].w, opaque_source, tint);
+        }
+    }
+    if (!direct)
+        out.blitfrom(tmp, 0, 0, cw, ch, x, y, mode);
+}
+
+genv::collision_mask::collision_mask() : w(0), h(0), words(0), x0(0), y0(0), x1(0), y1(0)
+{
+}
+
+genv::collision_mask::collision_mask(const canvas& c, int alpha_threshold)
+    : w(c.width()), h(c.height()), words((w + 63) / 64),
+      bits(static_cast<std::size_t>(words) * h), x0(w), y0(h), x1(0), y1(0)
+{
+    const SDL_PixelFormat* f = w ? c.buf->format : 0;
+    for (int y = 0; y < h; ++y)
+    {
+        unsigned long long* row = words ? &bits[static_cast<std::size_t>(y) * words] : 0;
+        for (int x = 0; x < w; ++x)
+        {
+            bool on = true;
+            if (c.alpha || c.transp) {
+                Uint32 v = c.value_at(x, y);
+                if (c.alpha) {
+                    Uint8 r, g, b, a;
+                    SDL_GetRGBA(v, f, &r, &g, &b, &a);
+                    on = a >= alpha_threshold;
+                } else if (f->palette) {
+                    on = read_rgb(c.buf, c.wrap_x(x), c.wrap_y(y)) != 0;
+                } else {
+                    on = (v & (f->Rmask | f->Gmask | f->Bmask)) != 0;
+                }
+            }
+            if (on) {
+                row[x >> 6] |= 1ULL << (x & 63);
+                x0 = std::min(x0, x); x1 = std::max(x1, x + 1);
+                y0 = std::min(y0, y); y1 = std::max(y1, y + 1);
+            }
+        }
+    }
+    if (x0 >= x1)
+        x0 = y0 = x1 = y1 = 0;
+}
+
+bool genv::collision_mask::solid(int x, int y) const
+{
+    if (x < 0 || y < 0 || x >= w || y >= h)
+        return false;
+    return (word(y, x >> 6) >> (x & 63)) & 1;
+}
+
+// the 64 bits of a row from bit p on, zeros outside the mask
+unsigned long long genv::collision_mask::bits_at(int row, int p) const
+{
+    int i = p >= 0 ? p / 64 : -((63 - p) / 64);
+    int sh = p - i * 64;
+    unsigned long long v = word(row, i) >> sh;
+    if (sh)
+        v |= word(row, i + 1) << (64 - sh);
+    return v;
+}
+
+bool genv::collision_mask::overlaps(int x, int y, const collision_mask& o, int ox, int oy) const
+{
+    // the boxes of the solid pixels, in the coordinates of this mask
+    int dx = ox - x, dy = oy - y;
+    int ax0 = std::max(x0, o.x0 + dx), ax1 = std::min(x1, o.x1 + dx);
+    int ay0 = std::max(y0, o.y0 + dy), ay1 = std::min(y1, o.y1 + dy);
+    if (ax0 >= ax1 || ay0 >= ay1)
+        return false;
+    // the words of this mask in the box, against those of o shifted under
+    // them; bits outside either mask are zero
+    int first = ax0 >> 6, last = (ax1 - 1) >> 6;
+    for (int row = ay0; row < ay1; ++row)
+        for (int i = first; i <= last; ++i)
+            if (word(row, i) & o.bits_at(row - dy, i * 64 - dx))
+                return true;
+    return false;
+}
+
+namespace
+{
+    struct sweep_box
+    {
+        int x0, y0, x1, y1;
+        int item;
+    };
+
+    bool by_left(const sweep_box& a, const sweep_box& b)
+    {
+        return a.x0 < b.x0;
+    }
+}
+
+void genv::find_collisions(const placed_mask* items, std::size_t n, std::vector<std::pair<int, int> >& hits)
+{
+    hits.clear();
+    std::vector<sweep_box> boxes;
+    boxes.reserve(n);
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        const collision_mask& m = *items[i].mask;
+        if (m.left() >= m.right())
+            continue;
+        sweep_box b = { items[i].x + m.left(), items[i].y + m.top(), items[i].x + m.right(), items[i].y + m.bottom(),
+                        static_cast<int>(i) };
+        boxes.push_back(b);
+    }
+    std::sort(boxes.begin(), boxes.end(), by_left);
+    // every box against the following ones that start before it ends
+    for (std::size_t i = 0; i < boxes.size(); ++i)
+    {
+        const sweep_box& a = boxes[i];
+        for (std::size_t j = i + 1; j < boxes.size() && boxes[j].x0 < a.x1; ++j)
+        {
+            const sweep_box& b = boxes[j];
+            if (b.y0 >= a.y1 || a.y0 >= b.y1)
+                continue;
+            const placed_mask& p = items[a.item];
+            const placed_mask& q = items[b.item];
+            if (p.mask->overlaps(p.x, p.y, *q.mask, q.x, q.y))
+                hits.push_back(std::make_pair(std::min(a.item, b.item), std::max(a.item, b.item)));
+        }
+    }
+}
+
+void genv::canvas::blit_transformed(const canvas& c, int sx, int sy, int w, int h, double tx, double ty,
+                                    double scale_x, double scale_y, double angle, double pivot_x, double pivot_y,
+                                    filter_mode filter, blend_mode mode)
+{
+    if (sx == -1) sx = 0;
+    if (sy == -1) sy = 0;
+    if (w == -1) w = c.buf->w - sx;
+    if (h == -1) h = c.buf->h - sy;
+    // the pivot stays where it was in the rectangle
+    if (sx < 0) { w += sx; pivot_x += sx; sx = 0; }
+    if (sy < 0) { h += sy; pivot_y += sy; sy = 0; }
+    w = std::min(w, c.buf->w - sx);
+    h = std::min(h, c.buf->h - sy);
+    if (w <= 0 || h <= 0 || scale_x == 0 || scale_y == 0)
+        return;
+
+    const SDL_PixelFormat* df = buf->format;
+    if (df->BytesPerPixel != 4 || (df->Rmask | df->Gmask | df->Bmask) != 0x00ffffff) {
+        // other targets get the result through an alpha canvas of the box
+        // it covers
+        int x0, y0, x1, y1;
+        if (!transformed_box(w, h, tx, ty, scale_x, scale_y, angle, pivot_x, pivot_y, buf->w, buf->h, x0, y0, x1, y1))
+            return;
+        alpha_canvas tmp(x1 - x0, y1 - y0);
+        tmp.blit_transformed(c, sx, sy, w, h, tx - x0, ty - y0, scale_x, scale_y, angle, pivot_x, pivot_y, filter);
+        blitfrom(tmp, 0, 0, x1 - x0, y1 - y0, x0, y0, mode);
+        return;
+    }
+    touch();
+
+    int kind = c.alpha ? alpha_source : c.transp ? keyed_source : opaque_source;
+    const SDL_PixelFormat* sf = c.buf->format;
+    bool same = sf->BytesPerPixel == 4 && sf->Rmask == df->Rmask && sf->Gmask == df->Gmask && sf->Bmask == df->Bmask &&
+                (!c.alpha || sf->Amask == 0xff000000);
+
+    // shrinking a mipmapped canvas samples the nearest halved level instead
+    const mip_level* mip = 0;
+    if (c.mipmap && same && &c != this) {
+        double scale = std::max(std::fabs(scale_x), std::fabs(scale_y));
+        int level = static_cast<int>(std::floor(std::log2(1 / scale) + 0.5));
+        if (level > 0) {
+            c.prepare_mipmaps();
+            level = std::min(level, static_cast<int>(c.mip_levels.size()));
+        }
+        if (level > 0) {
+            mip = &c.mip_levels[level - 1];
+            double f = 1.0 / (1 << level);
+            int lx = sx >> level, ly = sy >> level;
+            int lw = std::min(mip->w, static_cast<int>(std::ceil((sx + w) * f))) - lx;
+            int lh = std::min(mip->h, static_cast<int>(std::ceil((sy + h) * f))) - ly;
+            pivot_x = (sx + pivot_x) * f - lx;
+            pivot_y = (sy + pivot_y) * f - ly;
+            scale_x *= 1 << level;
+            scale_y *= 1 << level;
+            sx = lx; sy = ly; w = lw; h = lh;
+        }
+    }
+
+    // target to source: u = pivot + R(-angle) (X - t) / scale
+    double a = angle * 3.14159265358979323846 / 180;
+    double cs = std::cos(a), sn = std::sin(a);
+    double dudx = cs / scale_x, dvdx = -sn / scale_y, dudy = sn / scale_x, dvdy = cs / scale_y;
+
+    int x0, y0, x1, y1;
+    if (!transformed_box(w, h, tx, ty, scale_x, scale_y, angle, pivot_x, pivot_y, buf->w, buf->h, x0, y0, x1, y1))
+        return;
+
+    // the source as texels in the layout of the target; a copy when it is
+    // in another one, wrapped (ring), in the pixels of the target or keyed
+    // for filtering
+    std::vector<Uint32> copy;
+    texels t = { 0, w, w, h, 0, 0, 0 };
+    if (mip) {
+        t.px = reinterpret_cast<const Uint32*>(&mip->px[0]) + sy * mip->w + sx;
+        t.pitch = mip->w;
+        kind = alpha_source;
+    } else if (same && c.tiled && !shares_pixels(c) && filter == filter_nearest) {
+        t.tiles = c.buf;
+        t.x0 = sx;
+        t.y0 = sy;
+    } else if (same && !c.ring && !c.tiled && !shares_pixels(c) && !(kind == keyed_source && filter == filter_bilinear)) {
+        t.px = &pixel(c.buf, sx, sy);
+        t.pitch = c.buf->pitch / 4;
+    } else {
+        copy.resize(static_cast<std::size_t>(w) * h);
+        if (same) {
+            c.copy_out(sx, sy, w, h, reinterpret_cast<unsigned char*>(&copy[0]), w * 4);
+        } else {
+            for (int y = 0; y < h; ++y)
+                for (int x = 0; x < w; ++x)
+                {
+                    Uint8 r, g, b, al;
+                    SDL_GetRGBA(c.value_at(sx + x, sy + y), sf, &r, &g, &b, &al);
+                    copy[y * w + x] = static_cast<Uint32>(al) << 24 | static_cast<Uint32>(r) << df->Rshift |
+                                      static_cast<Uint32>(g) << df->Gshift | static_cast<Uint32>(b) << df->Bshift;
+                }
+        }
+        if (kind == keyed_source && filter == filter_bilinear) {
+            // the key becomes alpha, so that edges blend instead of the black
+            for (std::size_t i = 0; i < copy.size(); ++i)
+                copy[i] = source_pixel(copy[i], kind);
+            kind = alpha_source;
+        }
+        t.px = &copy[0];
+    }
+
+    blend_row_fn blend = blend_kernel(mode);
+    Uint32 tint = map_rgb(buf, draw_rgb) | 0xff000000;
+    const double fix = 65536;
+    long long du = std::llround(dudx * fix), dv = std::llround(dvdx * fix);
+    // bilinear samples are taken relative to the texel centers
+    int centre = filter == filter_bilinear ? 32768 : 0;
+    std::vector<Uint32> row(x1 - x0);
+    for (int y = y0; y < y1; ++y)
+    {
+        double ox = x0 + 0.5 - tx, oy = y + 0.5 - ty;
+        long long u = std::llround((pivot_x + ox * dudx + oy * dudy) * fix);
+        long long v = std::llround((pivot_y + ox * dvdx + oy * dvdy) * fix);
+        int first = 0, last = x1 - x0;
+        clip_steps(u, du, static_cast<long long>(w) << 16, first, last);
+        clip_steps(v, dv, static_cast<long long>(h) << 16, first, last);
+        if (first >= last)
+            continue;
+        int n = last - first;
+        long long su = u + first * du - centre, sv = v + first * dv - centre;
+        if (filter == filter_bilinear)
+            sample_bilinear(t, su, sv, du, dv, &row[0], n);
+        else
+            sample_nearest(t, su, sv, du, dv, &row[0], n);
+        SDL_Rect part[4], off[4];
+        int np = pieces(x0 + first, y, n, 1, part, off);
+        for (int i = 0; i < np; ++i)
+            if (tiled)
+                blend_tiled(blend, buf, part[i].x, part[i].y, &row[off[i].x], part[i].w, kind, tint);
+            else
+                blend(&pixel(buf, part[i].x, part[i].y), &row[off[i].x], part[i].w, kind, tint);
+    }
+}
+
+// a blit between the stored pixels, already clipped
+void genv::canvas::blit_part(const canvas& c, int sx, int sy, int w, int h, int tx, int ty, blend_mode mode)
+{
+    if (tiled || c.tiled) {
+        blit_tiled(c, sx, sy, w, h, tx, ty, mode);
+        return;
+    }
+    const SDL_PixelFormat* df = buf->format;
+    if (c.compact >= 0 && df->BytesPerPixel == 4 && (df->Rmask | df->Gmask | df->Bmask) == 0x00ffffff) {
+        // compact rows expanded into the target, or into a line blended there
+        expander e;
+        make_expander(e, c.buf, c.compact, df);
+        int kind = c.transp ? keyed_source : opaque_source;
+        bool copy = kind == opaque_source && mode == blend_normal;
+        blend_row_fn row = blend_kernel(mode);
+        Uint32 tint = map_rgb(buf, draw_rgb) | 0xff000000;
+        std::vector<Uint32> line(copy ? 0 : w);
+        for (int y=0; y<h; ++y)
+        {
+            const Uint8* src = static_cast<const Uint8*>(c.buf->pixels) + (sy + y) * c.buf->pitch;
+            if (copy) {
+                expand_row(e, src, sx, w, &pixel(buf, tx, ty + y));
+            } else {
+                expand_row(e, src, sx, w, &line[0]);
+                row(&pixel(buf, tx, ty + y), &line[0], w, kind, tint);
+            }
+        }
+        return;
+    }
+    // SDL blits into palettes through 3-3-2 colors and not into 1 bit at all
+    bool same = c.buf->format->format == df->format && c.compact == compact && c.palette == palette;
+    if (same && df->BitsPerPixel == 1 && mode == blend_normal) {
+        // rows of bits copied, or ORed for the black key
+        for (int y=0; y<h; ++y)
+            copy_bits(static_cast<const Uint8*>(c.buf->pixels) + (sy + y) * c.buf->pitch, sx,
+                      static_cast<Uint8*>(buf->pixels) + (ty + y) * buf->pitch, tx, w, c.transp);
+        return;
+    }
+    if (c.alpha || mode != blend_normal || (df->palette && !same)) {
+        const SDL_PixelFormat* sf = c.buf->format;
+        blend_row_fn row = blend_kernel(mode);
+        int kind = c.alpha ? alpha_source : c.transp ? keyed_source : opaque_source;
+        if (sf->BytesPerPixel == 4 && df->BytesPerPixel == 4 && (df->Rmask | df->Gmask | df->Bmask) == 0x00ffffff &&
+            sf->Rmask == df->Rmask && sf->Gmask == df->Gmask && sf->Bmask == df->Bmask &&
+            (!c.alpha || sf->Amask == 0xff000000)) {
+            Uint32 tint = map_rgb(buf, draw_rgb) | 0xff000000;
+            for (int y=0; y<h; ++y)
+                row(&pixel(buf, tx, ty + y), &pixel(c.buf, sx, sy + y), w, kind, tint);
+            return;
+        }
+        // any other formats through rows of ARGB8888
+        Uint32 tint = static_cast<Uint32>(draw_rgb) | 0xff000000;
+        compact_mapper to_compact(compact, palette);
+        std::vector<Uint32> src(w), dst(w);
+        for (int y=0; y<h; ++y)
+        {
+            Uint8 r, g, b, a;
+            for (int x=0; x<w; ++x)
+            {
+                SDL_GetRGBA(read_pixel(c.buf, sx + x, sy + y), sf, &r, &g, &b, &a);
+                src[x] = static_cast<Uint32>(a) << 24 | r << 16 | g << 8 | b;
+                SDL_GetRGBA(read_pixel(buf, tx + x, ty + y), df, &r, &g, &b, &a);
+                dst[x] = static_cast<Uint32>(a) << 24 | r << 16 | g << 8 | b;
+            }
+            row(&dst[0], &src[0], w, kind, tint);
+            for (int x=0; x<w; ++x)
+                write_pixel(buf, tx + x, ty + y, compact >= 0 ? to_compact(dst[x]) : SDL_MapRGBA(df, (dst[x] >> 16) & 0xff,
+                    (dst[x] >> 8) & 0xff, dst[x] & 0xff, dst[x] >> 24));
+        }
+        return;
+    }
+    if (c.transp && c.buf->format->format == buf->format->format &&
+        buf->format->BytesPerPixel == 4) {
+        // copy the prepared runs only, no per-pixel color key test
+        c.prepare_sprite();
+        for (int y=0; y<h; ++y)
+        {
+            Uint32* dst = &pixel(buf, 0, ty + y) + tx - sx;
+            const Uint32* src = &pixel(c.buf, 0, sy + y);
+            for (int i = c.sprite_rows[sy + y]; i < c.sprite_rows[sy + y + 1]; ++i)
+            {
+                const span& r = c.sprite_spans[i];
+                if (r.x >= sx + w)
+                    break;
+                int from = std::max(r.x, sx), to = std::min(r.x + r.len, sx + w);
+                if (from < to)
+                    std::memcpy(dst + from, src + from, (to - from) * sizeof(Uint32));
+            }
+        }
+        return;
+    }
+    SDL_Rect sr={sx,sy,w,h};
+    SDL_Rect tr={tx,ty,w,h};
+    if (c.transp) {
+        SDL_SetColorKey(c.buf, SDL_TRUE, SDL_MapRGB(c.buf->format, 0, 0 ,0));
+    } else {
+        // the surface may have been keyed before, also by a canvas sharing it
+        SDL_SetColorKey(c.buf, SDL_FALSE, 0);
+    }
+    SDL_BlitSurface(c.buf, &sr, buf, &tr);
 }
 
-
-genv::groutput::groutput()
+// blit_part() with tiles on either side: a plain copy goes from row to
+// row, the rest through rows of the source and of the target area
+void genv::canvas::blit_tiled(const canvas& c, int sx, int sy, int w, int h, int tx, int ty, blend_mode mode)
 {
-    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER) < 0)
-        exit(1);
-    // SDL_EnableUNICODE(1);
-    buf = 0;
-    if (TTF_Init() < 0)
-      exit(1);
+    if (!c.alpha && !c.transp && mode == blend_normal && c.buf->format->format == buf->format->format) {
+        std::vector<Uint8> line(c.tiled && tiled ? w * 4 : 0);
+        for (int y=0; y<h; ++y)
+            if (!tiled)
+                tiled_read(c.buf, sx, sy + y, w, pixel_row(buf, ty + y) + tx * 4);
+            else if (!c.tiled)
+                tiled_write(buf, tx, ty + y, w, pixel_row(c.buf, sy + y) + sx * 4);
+            else {
+                tiled_read(c.buf, sx, sy + y, w, &line[0]);
+                tiled_write(buf, tx, ty + y, w, &line[0]);
+            }
+        return;
+    }
+    canvas src, dst;
+    const canvas* from = &c;
+    if (c.tiled) {
+        src.buf = create_like(c.buf, w, h);
+        if (src.buf == 0)
+            return;
+        for (int y=0; y<h; ++y)
+            tiled_read(c.buf, sx, sy + y, w, pixel_row(src.buf, y));
+        src.transp = c.transp;
+        src.alpha = c.alpha;
+        from = &src;
+        sx = sy = 0;
+    }
+    if (!tiled) {
+        blit_part(*from, sx, sy, w, h, tx, ty, mode);
+        return;
+    }
+    dst.buf = create_like(buf, w, h);
+    if (dst.buf == 0)
+        return;
+    dst.alpha = alpha;
+    dst.draw_rgb = draw_rgb;
+    for (int y=0; y<h; ++y)
+        tiled_read(buf, tx, ty + y, w, pixel_row(dst.buf, y));
+    dst.blit_part(*from, sx, sy, w, h, 0, 0, mode);
+    for (int y=0; y<h; ++y)
+        tiled_write(buf, tx, ty + y, w, pixel_row(dst.buf, y));
 }
 
-genv::groutput::~groutput()
+inline int genv::canvas::wrap_x(int x) const
 {
-    if (buf) SDL_FreeSurface(buf);
-    if (wnd) SDL_DestroyWindow(wnd);
-    if (font) TTF_CloseFont(font);
-    buf=0;
-    font=0;
-    antialiastext=0;
-    SDL_Quit();
-    TTF_Quit();
+    x += org_x;
+    return x >= buf->w ? x - buf->w : x;
 }
 
-
-genv::canvas::~canvas() {
-    if (buf) SDL_FreeSurface(buf);
-    if (font) TTF_CloseFont(font);
+inline int genv::canvas::wrap_y(int y) const
+{
+    y += org_y;
+    return y >= buf->h ? y - buf->h : y;
 }
 
-bool genv::canvas::open(unsigned width, unsigned height)
+unsigned genv::canvas::value_at(int x, int y) const
 {
-    if (buf) SDL_FreeSurface(buf);
-    buf = SDL_CreateRGBSurface(0, width, height, 32,0,0,0,0);
-    pt_x = static_cast<short>(width/2);
-    pt_y = static_cast<short>(height/2);
-    return buf != 0;
+    x = wrap_x(x);
+    y = wrap_y(y);
+    return tiled ? *tiled_pixel(buf, x, y) : read_pixel(buf, x, y);
 }
 
-bool genv::groutput::open(unsigned width, unsigned height, bool fullscreen)
+int genv::canvas::pieces(int x, int y, int w, int h, SDL_Rect* part, SDL_Rect* off) const
 {
-    if (fullscreen) {
-        wnd = SDL_CreateWindow("SDL app", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, width, height, SDL_WINDOW_FULLSCREEN);
-    } else {
-        wnd = SDL_CreateWindow("SDL app", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, width, height, 0);
-    }
-    buf = SDL_GetWindowSurface(wnd);
-    pt_x = static_cast<short>(width/2);
-    pt_y = static_cast<short>(height/2);
-    return buf != 0;
+    int x0 = std::max(x, 0), y0 = std::max(y, 0);
+    int x1 = std::min(x + w, buf->w), y1 = std::min(y + h, buf->h);
+    if (x0 >= x1 || y0 >= y1)
+        return 0;
+    // stored position, offset in the rectangle and size of the (at most two)
+    // column and row ranges
+    int px = wrap_x(x0), py = wrap_y(y0);
+    int wa = std::min(x1 - x0, buf->w - px), ha = std::min(y1 - y0, buf->h - py);
+    int cols[2][3] = { { px, x0 - x, wa }, { 0, x0 - x + wa, x1 - x0 - wa } };
+    int rows[2][3] = { { py, y0 - y, ha }, { 0, y0 - y + ha, y1 - y0 - ha } };
+    int n = 0;
+    for (int j=0; j<2; ++j)
+        for (int i=0; i<2; ++i)
+        {
+            if (cols[i][2] <= 0 || rows[j][2] <= 0)
+                continue;
+            SDL_Rect p = { cols[i][0], rows[j][0], cols[i][2], rows[j][2] };
+            SDL_Rect o = { cols[i][1], rows[j][1], 0, 0 };
+            part[n] = p;
+            off[n] = o;
+            ++n;
+        }
+    return n;
 }
 
-
-void genv::groutput::showmouse(bool toggle) {
-    if (toggle)
-        SDL_ShowCursor(SDL_ENABLE);
-    else
-        SDL_ShowCursor(SDL_DISABLE);
-}
-void genv::groutput::movemouse(int x, int y) {
-    SDL_WarpMouseInWindow(wnd, x, y);
+// copies a clipped rectangle out of / into a plain pixel array of the same format
+void genv::canvas::copy_out(int x, int y, int w, int h, unsigned char* dst, int pitch) const
+{
+    int bpp = buf->format->BytesPerPixel;
+    bool bits = buf->format->BitsPerPixel < 8;
+    SDL_Rect part[4], off[4];
+    int n = pieces(x, y, w, h, part, off);
+    for (int i=0; i<n; ++i)
+        for (int row=0; row<part[i].h; ++row)
+            if (bits)
+                copy_bits(static_cast<const Uint8*>(buf->pixels) + (part[i].y + row) * buf->pitch, part[i].x,
+                          dst + (off[i].y + row) * pitch, off[i].x, part[i].w);
+            else if (tiled)
+                tiled_read(buf, part[i].x, part[i].y + row, part[i].w, dst + (off[i].y + row) * pitch + off[i].x * 4);
+            else
+                std::memcpy(dst + (off[i].y + row) * pitch + off[i].x * bpp,
+                        static_cast<const Uint8*>(buf->pixels) + (part[i].y + row) * buf->pitch + part[i].x * bpp,
+                        part[i].w * bpp);
 }
 
-bool genv::canvas::save(const std::string& file) const
+void genv::canvas::copy_in(const unsigned char* src, int pitch, int x, int y, int w, int h)
 {
-    return SDL_SaveBMP(buf, file.c_str()) == 0;
+    int bpp = buf->format->BytesPerPixel;
+    bool bits = buf->format->BitsPerPixel < 8;
+    SDL_Rect part[4], off[4];
+    int n = pieces(x, y, w, h, part, off);
+    for (int i=0; i<n; ++i)
+        for (int row=0; row<part[i].h; ++row)
+            if (bits)
+                copy_bits(src + (off[i].y + row) * pitch, off[i].x,
+                          static_cast<Uint8*>(buf->pixels) + (part[i].y + row) * buf->pitch, part[i].x, part[i].w);
+            else if (tiled)
+                tiled_write(buf, part[i].x, part[i].y + row, part[i].w, src + (off[i].y + row) * pitch + off[i].x * 4);
+            else
+                std::memcpy(static_cast<Uint8*>(buf->pixels) + (part[i].y + row) * buf->pitch + part[i].x * bpp,
+                        src + (off[i].y + row) * pitch + off[i].x * bpp,
+                        part[i].w * bpp);
 }
 
-void genv::groutput::set_title(const std::string& title) {
-	SDL_SetWindowTitle(wnd, title.c_str());
+// copies c into the top left corner, in the format and layout of this canvas
+void genv::canvas::paste(const canvas& c)
+{
+    touch();
+    if (buf == 0 || c.buf == 0)
+        return;
+    draw_clr = map_rgb(buf, draw_rgb, alpha);
+    // always a new surface, also if c shows the same pixels
+    SDL_Surface* rows = c.tiled || c.org_x || c.org_y ? c.rows_copy() : c.buf;
+    SDL_Surface* s = rows ? converted(rows) : 0;
+    if (rows != c.buf)
+        free_surface(rows);
+    if (s == 0)
+        return;
+    copy_in(static_cast<unsigned char*>(s->pixels), s->pitch, 0, 0, std::min(s->w, buf->w), std::min(s->h, buf->h));
+    free_surface(s);
 }
 
-
-void genv::canvas::set_color(int r, int g, int b)
+// moves a clipped rectangle within the canvas
+void genv::canvas::move_area(int sx, int sy, int w, int h, int tx, int ty)
 {
-    draw_clr = ((r & 0xff) << 16) | ((g & 0xff) << 8) | (b & 0xff);
+    if (!ring && !tiled) {
+        move_rect(buf, sx, sy, w, h, tx, ty);
+        return;
+    }
+    // the parts (or tiles) may overlap each other in any order, go through a copy
+    int pitch = buf->format->BitsPerPixel < 8 ? (w + 7) / 8 : w * buf->format->BytesPerPixel;
+    std::vector<unsigned char> tmp(static_cast<std::size_t>(pitch) * h);
+    copy_out(sx, sy, w, h, &tmp[0], pitch);
+    copy_in(&tmp[0], pitch, tx, ty, w, h);
 }
 
-bool genv::canvas::move_point(int x, int y)
+// gives a canvas sharing its pixels with copies a copy of its own, before
+// it draws on them
+void genv::canvas::unshare()
 {
-    int nx = pt_x + x;
-    int ny = pt_y + y;
-
-    if (nx < 0 || ny < 0 || nx >= buf->w || ny >= buf->h)
-        return false;
-
-    pt_x = static_cast<short>(nx);
-    pt_y = static_cast<short>(ny);
-    return true;
+    shared = false;
+    if (buf == 0 || buf->refcount < 2)
+        return;
+    SDL_Surface* s = create_like(buf, buf->w, buf->h);
+    if (s == 0)
+        return;
+    // tiles: the first bytes of every band, see tiled_access
+    std::size_t len = tiled ? ((buf->w + 7) & ~7) * 32 : row_bytes(buf);
+    for (int y = 0; y < buf->h; y += tiled ? 8 : 1)
+        std::memcpy(pixel_row(s, y), pixel_row(buf, y), tiled ? len * std::min(8, buf->h - y) / 8 : len);
+    free_surface(buf);
+    buf = s;
 }
 
-void genv::canvas::draw_dot()
+void genv::canvas::drop_derived()
 {
-    pixel(buf, pt_x, pt_y) = draw_clr;
+    derived = false;
+    sprite_spans.clear();
+    sprite_rows.clear();
+    mip_levels.clear();
 }
 
-void genv::canvas::draw_line(int x, int y)
+void genv::canvas::prepare_mipmaps() const
 {
-    int xdir = (x > 0 ? 1 : -1);
-    int ydir = (y > 0 ? 1 : -1);
-
-    int xstep = 0, ystep = 0;
-    int xshift = 0, yshift = 0;
-    int steps, shifts;
-
-    if (abs(x) >= abs(y))
-    {
-        xstep = xdir;
-        yshift = ydir;
-        steps = abs(x);
-        shifts = abs(y);
-    }
-    else
+    if (owner)
+        mip_levels.clear();
+    if (!mip_levels.empty() || buf == 0 || buf->format->BytesPerPixel != 4 ||
+        (buf->format->Rmask | buf->format->Gmask | buf->format->Bmask) != 0x00ffffff)
+        return;
+    // the levels have alpha on top, black of a transparent canvas is clear
+    int kind = alpha ? alpha_source : transp ? keyed_source : opaque_source;
+    std::vector<Uint32> base(static_cast<std::size_t>(buf->w) * buf->h);
+    copy_out(0, 0, buf->w, buf->h, reinterpret_cast<unsigned char*>(&base[0]), buf->w * 4);
+    for (std::size_t i = 0; i < base.size(); ++i)
+        base[i] = source_pixel(base[i], kind);
+    const Uint32* src = &base[0];
+    int w = buf->w, h = buf->h;
+    while (w > 1 || h > 1)
     {
-        ystep = ydir;
-        xshift = xdir;
-        steps = abs(y);
-        shifts = abs(x);
+        mip_level m;
+        m.w = (w + 1) / 2;
+        m.h = (h + 1) / 2;
+        m.px.resize(static_cast<std::size_t>(m.w) * m.h);
+        halve(src, w, h, reinterpret_cast<Uint32*>(&m.px[0]));
+        mip_levels.push_back(m);
+        src = reinterpret_cast<const Uint32*>(&mip_levels.back().px[0]);
+        w = m.w;
+        h = m.h;
     }
+    derived = true;
+}
 
-    draw_dot();
-
-    int len=0;
-    bool noclip = true;
-    for (int i=0; noclip && i<steps; ++i)
+void genv::canvas::prepare_sprite() const
+{
+    if (owner) {
+        // drawing on the parent does not reach the views, no caching
+        sprite_spans.clear();
+        sprite_rows.clear();
+    }
+    if (!sprite_rows.empty() || buf == 0 || buf->format->BytesPerPixel != 4)
+        return;
+    Uint32 rgb = buf->format->Rmask | buf->format->Gmask | buf->format->Bmask;
+    sprite_rows.reserve(buf->h + 1);
+    for (int y=0; y<buf->h; ++y)
     {
-        if ((len+=shifts) >= steps)
+        sprite_rows.push_back(static_cast<int>(sprite_spans.size()));
+        const Uint32* row = &pixel(buf, 0, y);
+        int x = 0;
+        while (x < buf->w)
         {
-            noclip = move_point(xstep + xshift, ystep + yshift);
-            len -= steps;
+            while (x < buf->w && (row[x] & rgb) == 0)
+                ++x;
+            int start = x;
+            while (x < buf->w && (row[x] & rgb) != 0)
+                ++x;
+            if (x > start)
+            {
+                span r = { start, x - start };
+                sprite_spans.push_back(r);
+            }
         }
-        else
-            noclip = move_point(xstep, ystep);
-
-        if (noclip)
-                draw_dot();
     }
+    sprite_rows.push_back(static_cast<int>(sprite_spans.size()));
+    derived = true;
 }
 
-void genv::canvas::draw_box(int x, int y)
+bool genv::canvas::load_bitmap_font(const std::string& fname)
 {
-    SDL_Rect r = {pt_x, pt_y, 0, 0};
-    if (!move_point(x, y))
-        return;
-
-    if (x > 0)
-        r.w = x+1;
-    else
-    {
-        r.x += x;
-        r.w = -x+1;
-    }
-    if (y > 0)
-        r.h = y+1;
-    else
-    {
-        r.y += y;
-        r.h = -y+1;
-    }
+    std::shared_ptr<bitmap_font> f(new bitmap_font);
+    if (!f->load(fname.c_str()))
+        return false;
+    bmfont = f;
+    // the bitmap font replaces the SDL_ttf one
+    font.reset();
+    gcache.reset();
+    return true;
+}
 
-    SDL_FillRect(buf, &r, draw_clr);
+void genv::canvas::set_glyph_cache_dir(const std::string& dir)
+{
+    glyph_cache_dir = dir;
+    while (!glyph_cache_dir.empty() && (*glyph_cache_dir.rbegin() == '/' || *glyph_cache_dir.rbegin() == '\\'))
+        glyph_cache_dir.erase(glyph_cache_dir.size() - 1);
 }
 
-void genv::canvas::draw_text(const std::string& str)
+void genv::canvas::scroll(int dx, int dy, int x, int y, int w, int h, bool fill)
 {
-    if (font == 0) {
-        int left = pt_x;
-        if (pt_y - cascent() < 0 || pt_y + cdescent() >= buf->h)
-            return;
-        for (unsigned i=0; i<str.length(); ++i)
+    if (buf == 0)
+        return;
+    if (w < 0) w = buf->w - x;
+    if (h < 0) h = buf->h - y;
+    int tx = x, ty = y;
+    if (!clip_blit(x, y, w, h, tx, ty, buf->w, buf->h, buf->w, buf->h))
+        return;
+    touch();
+    int mw = w - std::abs(dx), mh = h - std::abs(dy);
+    if (ring && w == buf->w && h == buf->h)
+    { // the stored pixels stay, the origin moves
+        org_x = ((org_x - dx) % w + w) % w;
+        org_y = ((org_y - dy) % h + h) % h;
+    }
+    else if (mw > 0 && mh > 0)
+        move_area(x + std::max(0, -dx), y + std::max(0, -dy), mw, mh,
+                  x + std::max(0, dx), y + std::max(0, dy));
+    if (fill)
+    {
+        SDL_Rect band[2];
+        int n = 0;
+        if (dy != 0)
         {
-            if (str[i] == '\n')
-            {
-                if (!move_point(left - pt_x, charheight))
-                    return;
-                continue;
-            }
-            unsigned char code = str[i];
-            for (int col = 0; col < charwidth; ++col)
-            {
-                pt_y -= static_cast<short>(cascent());
-                for (int row = 0; row < charheight; ++row)
-                {
-                    unsigned px = (charfaces[code][row] >> 4*col) & 0xF;
-
-                    /* draw default font on baseline, causes access violation 
-                       if pt_y + cascent() points outside the surface :( */
-                    // project(buf, draw_clr, pt_x, pt_y + cascent(), px, 15);
-
-                    // default font not on baseline
-                    project(buf, draw_clr, pt_x, pt_y, px, 15);
-                    ++pt_y;
-                }
-                pt_y -= static_cast<short>(cdescent());
-
-                if (pt_x < buf->w-1)
-                    ++pt_x;
-                else
-                    return;
-            }
+            SDL_Rect r = { x, dy > 0 ? y : y + std::max(0, mh), w, std::min(std::abs(dy), h) };
+            band[n++] = r;
         }
-    }
-    else { // SDL_ttf
-        // get color from draw_clr:
-        typedef unsigned char uchar;
-        uchar r = static_cast<uchar>((draw_clr & 0xff0000) >> 16);
-        uchar g = static_cast<uchar>((draw_clr & 0x00ff00) >>  8);
-        uchar b = static_cast<uchar>((draw_clr & 0x0000ff));
-        SDL_Color text_clr = {r, g, b, 0xFF};
-        SDL_Surface* t = nullptr;
-        // render text in blended mode (AA)
-        if (antialiastext) {
-            t = TTF_RenderUTF8_Blended(font, str.c_str(), text_clr);
-        } else {
-            t = TTF_RenderUTF8_Solid(font, str.c_str(), text_clr);
+        if (dx != 0)
+        {
+            SDL_Rect r = { dx > 0 ? x : x + std::max(0, mw), y, std::min(std::abs(dx), w), h };
+            band[n++] = r;
+        }
+        for (int i=0; i<n; ++i)
+        {
+            SDL_Rect part[4], off[4];
+            int np = pieces(band[i].x, band[i].y, band[i].w, band[i].h, part, off);
+            fill_rects(buf, part, np, draw_clr, tiled);
         }
-        SDL_Rect offset;
-        offset.x = pt_x;
-        offset.y = pt_y;
-        pt_x += static_cast<short>(t->w);
-        SDL_BlitSurface( t, NULL, buf, &offset );
-        //std::cout << "DIMENSIONS: " << t->w << "," << t->h << std::endl;
-        SDL_FreeSurface(t);
     }
 }
 
-void genv::canvas::blitfrom(const genv::canvas &c, short x1, short y1, short x2, short y2, short x3, short y3) {
-    if (x1==-1) x1=0;
-    if (y1==-1) y1=0;
-    if (x2==-1) x2=static_cast<short>(c.buf->w);
-    if (y2==-1) y2=static_cast<short>(c.buf->h);
-    SDL_Rect sr={x1,y1,x2,y2};
-    SDL_Rect tr={x3,y3,x2,y2};
-    if (c.transp) {
-        SDL_SetColorKey(c.buf, SDL_TRUE, SDL_MapRGB(c.buf->format, 0, 0 ,0));
-    }
-    SDL_BlitSurface(c.buf, &sr, buf, &tr);
+bool genv::canvas::load_font(const std::string& fname, int fontsize, bool antialias)
+{
+  return load_font(fname.c_str(), fontsize, antialias);
 }
 
-bool genv::canvas::load_font(const std::string& fname, int fontsize, bool antialias)
+bool genv::canvas::load_font(const char* fname, int fontsize, bool antialias)
 {
   if (fontsize < 0)
     fontsize = 16;
-  // loading font
-  if(font) {
-  	TTF_CloseFont(font);
-  	font=0;
+  // same font requested again (e.g. a font manipulator in every frame)
+  if (!(font && font_size == fontsize && loaded_font_file_name == fname)) {
+    // loading font
+    gcache.reset();
+    font.reset();
+    _TTF_Font* f = TTF_OpenFont( fname, fontsize );
+    if (f == 0) // loading error
+      return false;
+    font.reset(f, TTF_CloseFont);
+    loaded_font_file_name=fname;
+    font_size=fontsize;
   }
-  font = TTF_OpenFont( fname.c_str(), fontsize );
-  if (font == 0) // loading error
-    return false;
-  loaded_font_file_name=fname;
-  font_size=fontsize;
   antialiastext=antialias;
+  if (glyph_cache_dir.empty())
+    gcache.reset();
+  else if (!gcache || gcache->antialias != antialias)
+    gcache = glyph_cache::open(fname, fontsize, antialias);
   return true;
 }
 
 void genv::groutput::refresh()
 {
+    if (screen != buf && screen && buf) {
+        if (screen->format->BytesPerPixel == 4 && buf->format->format == screen->format->format) {
+            // every row enlarged once, then copied below itself
+            std::size_t len = static_cast<std::size_t>(buf->w) * zoom * sizeof(Uint32);
+            for (int y = 0; y < buf->h; ++y)
+            {
+                Uint32* out = &pixel(screen, 0, y * zoom);
+                enlarge_row(&pixel(buf, 0, y), buf->w, zoom, out);
+                for (int k = 1; k < zoom; ++k)
+                    std::memcpy(&pixel(screen, 0, y * zoom + k), out, len);
+            }
+        } else {
+            SDL_BlitScaled(buf, 0, screen, 0);
+        }
+    }
     SDL_UpdateWindowSurface(wnd);
+    // glyphs rendered since go to the cache files
+    for (std::size_t i=0; i<glyph_caches.size(); ++i)
+        if (std::shared_ptr<glyph_cache> c = glyph_caches[i].lock())
+            c->flush();
 }
 
 genv::groutput& genv::groutput::instance()
@@ -442,8 +4516,8 @@ genv::grinput& genv::grinput::wait_event(event& ev)
                 ev.type = ev_mouse;
                 ev.button = se.button.button;
                 ev.button *= (se.button.state == SDL_RELEASED ? -1 : 1);
-                ev.pos_x = se.button.x;
-                ev.pos_y = se.button.y;
+                ev.pos_x = se.button.x / gout.scale();
+                ev.pos_y = se.button.y / gout.scale();
                 got = true;
                 break;
             case SDL_MOUSEWHEEL: // TODO fix touchpad scrolling
@@ -453,8 +4527,8 @@ genv::grinput& genv::grinput::wait_event(event& ev)
                 break;
             case SDL_MOUSEMOTION:
                 ev.type = ev_mouse;
-                ev.pos_x = se.motion.x;
-                ev.pos_y = se.motion.y;
+                ev.pos_x = se.motion.x / gout.scale();
+                ev.pos_y = se.motion.y / gout.scale();
                 got = true;
                 break;
             case SDL_USEREVENT:
@@ -477,22 +4551,39 @@ genv::grinput& genv::grinput::instance()
 
 int genv::canvas::cascent() const
 {
+    if (font == 0 && bmfont)
+        return bmfont->ascent;
     if (font == 0)
         return charheight - chardescent;
     // SDL_ttf ascent
-    return TTF_FontAscent(font);
+    return TTF_FontAscent(font.get());
 }
 
 int genv::canvas::cdescent() const
 {
+    if (font == 0 && bmfont)
+        return bmfont->height - bmfont->ascent;
     if (font == 0)
         return chardescent;
     // SDL_ttf descent
-    return -TTF_FontDescent(font);
+    return -TTF_FontDescent(font.get());
 }
 
 int genv::canvas::twidth(const std::string& s) const
 {
+    if (font == 0 && bmfont) {
+        int max = 0, cur = 0;
+        const char* p = s.data();
+        const char* end = p + s.length();
+        while (p < end)
+        {
+            if (next_utf8(p, end) == '\n')
+                cur = 0;
+            else
+                max = std::max(max, ++cur);
+        }
+        return max * bmfont->width;
+    }
     if (font == 0) {
         std::string::const_iterator prev = s.begin(), next;
         next = std::find(prev, s.end(), '\n');
@@ -508,8 +4599,211 @@ int genv::canvas::twidth(const std::string& s) const
         return max * charwidth;
     }
     // SDL_ttf width:
+    if (gcache && gcache->antialias == antialiastext) {
+        // advances and kerning as draw_text() adds them; no line breaks,
+        // like TTF_SizeUTF8
+        int w = 0;
+        unsigned prev = 0;
+        const char* p = s.data();
+        const char* end = p + s.length();
+        while (p < end)
+        {
+            unsigned cp = next_utf8(p, end);
+#ifdef SDL_TTF_VERSION_ATLEAST
+#if SDL_TTF_VERSION_ATLEAST(2,0,14)
+            if (prev && prev <= 0xffff && cp <= 0xffff)
+                w += TTF_GetFontKerningSizeGlyphs(font.get(), static_cast<Uint16>(prev), static_cast<Uint16>(cp));
+#endif
+#endif
+            w += gcache->get(font.get(), cp).advance;
+            prev = cp;
+        }
+        return w;
+    }
     int w,h;
-    TTF_SizeUTF8(font, s.c_str(), &w, &h);
+    TTF_SizeUTF8(font.get(), s.c_str(), &w, &h);
     return w;
 }
 
+
+
+genv::textgrid::textgrid(canvas& c, int cols, int rows, int x, int y) :
+    out(c), bmfont(c.bmfont), ncols(cols), nrows(rows), left(x), top(y),
+    cell_w(bmfont ? bmfont->width : charwidth),
+    cell_h(bmfont ? bmfont->height : charheight),
+    cells(cols*rows), dirty(cols*rows), dirty_cells()
+{
+    set_color(255,255,255);
+    set_background(0,0,0);
+    clear();
+}
+
+void genv::textgrid::set_color(int r, int g, int b)
+{
+    fg_clr = ((r & 0xff) << 16) | ((g & 0xff) << 8) | (b & 0xff);
+}
+
+void genv::textgrid::set_background(int r, int g, int b)
+{
+    bg_clr = ((r & 0xff) << 16) | ((g & 0xff) << 8) | (b & 0xff);
+}
+
+void genv::textgrid::store(int idx, unsigned ch)
+{
+    cell& c = cells[idx];
+    if (c.ch == ch && c.fg == fg_clr && c.bg == bg_clr)
+        return;
+    c.ch = ch;
+    c.fg = fg_clr;
+    c.bg = bg_clr;
+    if (!dirty[idx])
+        dirty_cells.push_back(idx);
+    dirty[idx] = 1;
+}
+
+void genv::textgrid::put(int col, int row, unsigned ch)
+{
+    if (col < 0 || row < 0 || col >= ncols || row >= nrows)
+        return;
+    store(row * ncols + col, ch);
+}
+
+void genv::textgrid::print(int col, int row, const std::string& str)
+{
+    int left_col = col;
+    const char* p = str.data();
+    const char* end = p + str.length();
+    while (p < end)
+    {
+        unsigned ch = bmfont ? next_utf8(p, end) : static_cast<unsigned char>(*p++);
+        if (ch == '\n')
+        {
+            col = left_col;
+            ++row;
+            continue;
+        }
+        put(col++, row, ch);
+    }
+}
+
+void genv::textgrid::clear()
+{
+    for (int i=0; i<ncols*nrows; ++i)
+        store(i, ' ');
+}
+
+void genv::textgrid::invalidate()
+{
+    dirty_cells.clear();
+    for (int i=0; i<ncols*nrows; ++i)
+    {
+        dirty[i] = 1;
+        dirty_cells.push_back(i);
+    }
+}
+
+void genv::textgrid::draw()
+{
+    if (out.buf == 0 || dirty_cells.empty())
+        return;
+    out.touch();
+    for (size_t i=0; i<dirty_cells.size(); ++i)
+    {
+        int idx = dirty_cells[i];
+        const cell& c = cells[idx];
+        SDL_Rect part[4], off[4];
+        int n = out.pieces(left + (idx % ncols) * cell_w, top + (idx / ncols) * cell_h, cell_w, cell_h, part, off);
+        cell_paint paint(glyph_color(out.buf, c.fg), glyph_color(out.buf, c.bg));
+        if (bmfont) {
+            mono_glyph g = { bmfont->glyph(bmfont->lookup(c.ch)), bmfont->stride };
+            blit_glyph(out.buf, part, off, n, g, paint, out.tiled);
+        } else {
+            nibble_glyph g = { charfaces[c.ch & 0xff] };
+            blit_glyph(out.buf, part, off, n, g, paint, out.tiled);
+        }
+        dirty[idx] = 0;
+    }
+    dirty_cells.clear();
+}
+
+
+void genv::number::format_int(unsigned long long v, bool neg, int width)
+{
+    char digits[24];
+    int n = 0;
+    do {
+        digits[n++] = static_cast<char>('0' + v % 10);
+        v /= 10;
+    } while (v);
+    if (neg)
+        digits[n++] = '-';
+    width = std::min(width, static_cast<int>(sizeof(buf)) - 1);
+    len = 0;
+    while (len < width - n)
+        buf[len++] = ' ';
+    while (n)
+        buf[len++] = digits[--n];
+    buf[len] = 0;
+}
+
+genv::number::number(int v, int width)
+{
+    format_int(v < 0 ? 0ull - v : v, v < 0, width);
+}
+
+genv::number::number(long v, int width)
+{
+    format_int(v < 0 ? 0ull - v : v, v < 0, width);
+}
+
+genv::number::number(long long v, int width)
+{
+    format_int(v < 0 ? 0ull - v : v, v < 0, width);
+}
+
+genv::number::number(unsigned v, int width)
+{
+    format_int(v, false, width);
+}
+
+genv::number::number(unsigned long v, int width)
+{
+    format_int(v, false, width);
+}
+
+genv::number::number(unsigned long long v, int width)
+{
+    format_int(v, false, width);
+}
+
+genv::number::number(double v, int precision, int width)
+{
+    if (precision < 0)
+        len = std::snprintf(buf, sizeof(buf), "%*g", width, v);
+    else
+        len = std::snprintf(buf, sizeof(buf), "%*.*f", width, precision, v);
+    len = std::max(0, std::min(len, static_cast<int>(sizeof(buf)) - 1));
+}
+
+genv::textf::textf(const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    len = std::vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    if (len < static_cast<int>(sizeof(buf))) {
+        len = std::max(len, 0);
+        return;
+    }
+    // cut: back to the first byte of the last character, which is dropped
+    // unless all of its bytes fit
+    len = sizeof(buf) - 1;
+    int i = len - 1;
+    while (i > 0 && (buf[i] & 0xc0) == 0x80)
+        --i;
+    unsigned char lead = static_cast<unsigned char>(buf[i]);
+    int need = lead >= 0xf0 ? 4 : lead >= 0xe0 ? 3 : lead >= 0xc0 ? 2 : 1;
+    if (i + need > len)
+        len = i;
+    buf[len] = 0;
+}
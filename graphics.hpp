@@ -2,15 +2,81 @@
 #define GRAPHICS_HPP_INCLUDED
 
 #include <string>
+#include <vector>
+#include <memory>
+#include <cstring>
+#include <cstddef>
+#include <utility>
+
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#include <string_view>
+#define GENV_HAS_STRING_VIEW
+#endif
+
+// lets GCC and Clang check printf style arguments against the format
+#if defined(__GNUC__)
+#define GENV_PRINTF(fmt, args) __attribute__((format(printf, fmt, args)))
+#else
+#define GENV_PRINTF(fmt, args)
+#endif
 
 struct SDL_Window;
 struct SDL_Surface;
+struct SDL_Rect;
 struct _TTF_Font;
 
 
 namespace genv
 {
 
+class bitmap_font;
+class glyph_cache;
+class tile_store;
+
+// How stamp combines the pixels of a canvas with the target. normal copies,
+// keys out black (transparent) or composites (alpha_canvas); the others
+// take the alpha or the color key into account the same way. tint
+// multiplies the source with the drawing color of the target first.
+enum blend_mode {
+    blend_normal, blend_add, blend_multiply, blend_screen, blend_min, blend_max, blend_tint
+};
+
+// Sampling of scaled and rotated stamps.
+enum filter_mode {
+    filter_nearest, filter_bilinear
+};
+
+enum flip_t {
+    flip_none = 0, flip_x = 1, flip_y = 2
+};
+
+class canvas;
+
+// A rectangle of the sheet of an atlas, stamped like a canvas. Lives as
+// long as the atlas; without a sheet when it did not fit, stamping it
+// then draws nothing.
+struct atlas_region
+{
+    canvas* sheet;
+    int x, y, w, h;
+    atlas_region() : sheet(0), x(0), y(0), w(0), h(0) {}
+    bool valid() const { return sheet != 0; }
+};
+
+// One region of a stamp_batch: the rectangle sx, sy, w, h of the sheet
+// drawn at x, y, mirrored by flip (flip_x | flip_y), multiplied by tint
+// (0xRRGGBB) unless that is -1.
+struct batch_item
+{
+    int sx, sy, w, h, x, y;
+    int flip;
+    int tint;
+    batch_item(int sx_, int sy_, int w_, int h_, int x_, int y_, int f = flip_none, int t = -1) :
+        sx(sx_), sy(sy_), w(w_), h(h_), x(x_), y(y_), flip(f), tint(t) {}
+    batch_item(const atlas_region& r, int x_, int y_, int f = flip_none, int t = -1) :
+        sx(r.x), sy(r.y), w(r.w), h(r.h), x(x_), y(y_), flip(f), tint(t) {}
+};
+
 /*********** Graphical output device definition ***********/
 
 class canvas {
@@ -18,24 +84,77 @@ public:
     canvas();
     virtual ~canvas();
     canvas(int w, int h);
+    // Copies share the pixels until one of them draws, moves take them over.
+    // A canvas moved from a view shows the same rectangle of the parent;
+    // moving from a parent of views ends the views. The window and
+    // mapped_canvas cannot be moved. Assigning to them or to a parent of
+    // views copies into its pixels, from the top left corner, and keeps
+    // their size and format.
     canvas(const canvas & c);
 	genv::canvas& operator=(const genv::canvas &c);
+    canvas(canvas&& c) noexcept;
+    canvas& operator=(canvas&& c) noexcept;
     bool open(unsigned width, unsigned height);
     bool save(const std::string& file) const;
-    void transparent(bool t) {transp=t;}
-    void set_color(int r, int g, int b);
+    // BMP image, converted to the format of the window
+    bool load(const std::string& file);
+
+    // SDL_PixelFormatEnum value of the pixels. New canvases and copies take
+    // the format of gout; stamping onto gout is a plain copy only then.
+    unsigned format() const;
+    std::string format_name() const;
+    bool native() const;
+    // for canvases made or loaded before gout.open()
+    bool convert_to_native();
+    // the mipmaps have the key built in, they are made again
+    void transparent(bool t) { if (t != transp) mip_levels.clear(); transp = t; }
+    // the alpha is stored by alpha_canvas only
+    void set_color(int r, int g, int b, int a = 255);
     bool move_point(int x, int y);
     void draw_dot();
     void draw_line(int x, int y);
     void draw_box(int x, int y);
     void draw_text(const std::string& str);
-    void blitfrom(const canvas &c, short x1, short y1, short x2, short y2, short x3, short y3);
+    void draw_text(const char* str, std::size_t len);
+    void blitfrom(const canvas &c, int x1, int y1, int x2, int y2, int x3, int y3,
+                  blend_mode mode = blend_normal);
+    // Stamps many regions of one sheet, clipped up front and copied in one
+    // loop, in order or sorted by target position (ties keep their order).
+    void blit_batch(const canvas& sheet, const batch_item* items, std::size_t n, bool sort_by_target = false);
+    // Draws a rectangle of c (-1: all of it) scaled, then rotated by angle
+    // degrees (clockwise) around the pivot, a point relative to the
+    // rectangle, which lands on tx, ty.
+    void blit_transformed(const canvas& c, int sx, int sy, int w, int h, double tx, double ty,
+                          double scale_x, double scale_y, double angle, double pivot_x, double pivot_y,
+                          filter_mode filter = filter_nearest, blend_mode mode = blend_normal);
+    // Moves the contents of a rectangle (by default the whole canvas) by
+    // dx,dy in place; with fill the uncovered band gets the drawing color.
+    // A ring_canvas scrolled as a whole just moves its origin.
+    void scroll(int dx, int dy, int x=0, int y=0, int w=-1, int h=-1, bool fill=false);
+    // Collects the runs of non-black pixels of a transparent canvas, so that
+    // stamping it copies only those. Done on the first stamp anyway, drawing
+    // on the canvas drops the runs.
+    void prepare_sprite() const;
+    // Lets affine_stamp shrink this canvas from a chain of halved copies,
+    // which is made on the first such stamp (or here) and dropped by drawing.
+    void mipmaps(bool m) { mipmap = m; }
+    void prepare_mipmaps() const;
 
     bool load_font(const std::string& fname, int fontsize = 16, bool antialias=true);
+    bool load_font(const char* fname, int fontsize = 16, bool antialias=true);
+    // BDF or PSF (v1/v2) fixed cell font, used instead of the built-in one
+    bool load_bitmap_font(const std::string& fname);
     void set_antialias(bool antialias) {antialiastext=antialias;}
+    // Existing directory for rasterized SDL_ttf glyphs, reused by fonts
+    // loaded afterwards, also in later runs. Empty turns the cache off.
+    // New glyphs are written by gout.refresh() (at most every 5 seconds)
+    // and when the last canvas using the font lets it go.
+    static void set_glyph_cache_dir(const std::string& dir);
 
     int x() const { return pt_x; }
     int y() const { return pt_y; }
+    int width() const;
+    int height() const;
 
     int cascent() const;
     int cdescent() const;
@@ -60,19 +179,377 @@ protected:
         if (a < 0) { return -1; } else if (a > 0) { return 1; } else { return 0; }
     }
 
-    short pt_x;
-    short pt_y;
+    // Splits a rectangle into the parts stored contiguously in buf (one, or
+    // up to four for a ring_canvas), clipped to the canvas. off gets the
+    // position of every part inside the rectangle.
+    int pieces(int x, int y, int w, int h, SDL_Rect* part, SDL_Rect* off) const;
+    int wrap_x(int x) const;
+    int wrap_y(int y) const;
+    // c is this canvas, a view of it, its parent or another view of that
+    bool shares_pixels(const canvas& c) const;
+    void blit_part(const canvas& c, int sx, int sy, int w, int h, int tx, int ty, blend_mode mode);
+    void blit_tiled(const canvas& c, int sx, int sy, int w, int h, int tx, int ty, blend_mode mode);
+    // the stored value of a pixel, x and y from the origin, also in tiles
+    unsigned value_at(int x, int y) const;
+    void copy_out(int x, int y, int w, int h, unsigned char* dst, int pitch) const;
+    void copy_in(const unsigned char* src, int pitch, int x, int y, int w, int h);
+    void paste(const canvas& c);
+    void move_area(int sx, int sy, int w, int h, int tx, int ty);
+    unsigned own_format() const;
+    // a surface of own_format(), with the palette of the canvas
+    SDL_Surface* new_surface(int w, int h) const;
+    SDL_Surface* converted(SDL_Surface* src) const;
+    // a copy of the pixels in rows from the origin on (ring or tiled canvases)
+    SDL_Surface* rows_copy() const;
+
+    // must precede every change of the pixels, drops what was derived from
+    // them, also by the canvas a view shows
+    void touch() { ++changes; if (shared) unshare(); if (derived) drop_derived(); if (owner) owner->touch(); }
+    void drop_derived();
+    void unshare();
+
+    struct span
+    {
+        int x, len;
+    };
+
+    struct mip_level
+    {
+        int w, h;
+        std::vector<unsigned> px;   // alpha on top, premultiplied
+    };
+
+    int pt_x;
+    int pt_y;
     SDL_Surface* buf;
-    int draw_clr;
+    int draw_rgb;       // as given to set_color, alpha in the top byte
+    int draw_clr;       // the same in the pixel format of buf
     bool transp;
-    _TTF_Font* font;
+    std::shared_ptr<_TTF_Font> font;
     bool antialiastext;
     std::string loaded_font_file_name;
     int font_size;
+    std::shared_ptr<bitmap_font> bmfont;
+    std::shared_ptr<glyph_cache> gcache;
+
+    bool ring;
+    int org_x, org_y;   // where the ring_canvas origin is stored in buf
+    bool alpha;         // alpha_canvas, premultiplied
+    int compact;        // compact_format of a compact_canvas, -1 otherwise
+    std::vector<unsigned> palette;  // its colors as 0xRRGGBB, 8 and 1 bit formats
+    bool tiled;         // tiled_canvas, buf holds 8x8 tiles instead of rows
+    canvas* owner;      // whose pixels a canvas_view shows
+    unsigned long changes;  // counts touch(), for the compositor
+    mutable bool shared;    // buf may be used by copies too (its refcount)
+    bool pinned;            // the window or the parent of views: buf stays, copies get their own
+
+    mutable bool derived;
+    mutable std::vector<span> sprite_spans;
+    mutable std::vector<int> sprite_rows;   // first span of every row, and the end
+    bool mipmap;
+    mutable std::vector<mip_level> mip_levels;      // half, quarter, ... size
+
+    friend class textgrid;
+    friend class canvas_view;
+    friend class compositor;
+    friend class accumulator;
+    friend class collision_mask;
+};
+
 
+
+
+// Canvas whose rows and columns wrap around inside the pixel storage, like
+// a circular buffer. Scrolling the whole canvas only moves the origin, it
+// costs as much as filling the uncovered strip; stamping it out composes
+// at most four pieces. Meant for strip charts and terminals.
+class ring_canvas : public canvas
+{
+public:
+    ring_canvas() { ring = true; }
+    ring_canvas(int w, int h) : canvas(w, h) { ring = true; }
+};
+
+
+// Canvas with per-pixel alpha, starting fully transparent. Colors are stored
+// premultiplied; drawing writes the alpha given to color(), stamping the
+// canvas composites it over the target (soft edges, translucency) instead
+// of the black color key of transparent(). Same pixel layout as the window
+// plus an alpha byte, the blend runs on SSE2/AVX2 where available.
+class alpha_canvas : public canvas
+{
+public:
+    alpha_canvas() { alpha = true; }
+    alpha_canvas(int w, int h) { alpha = true; open(w, h); }
 };
 
 
+// Storage of compact_canvas: RGB565, 8 bit gray, 8 bit indices of a palette
+// or 1 bit (black and white, e.g. masks), MSB first.
+enum compact_format {
+    compact_rgb565, compact_gray8, compact_indexed8, compact_mask1
+};
+
+// Canvas with 2 bytes, 1 byte or 1 bit per pixel instead of 4, for masks,
+// gray images, palette sprites and large maps. Drawing works on the stored
+// values: colors become the nearest one that can be stored (the mean of the
+// channels for gray, any non-black one white for a mask). Stamping onto a
+// 32 bit canvas or the window expands the rows with SSE2/AVX2. Copies keep
+// the format, loading converts into it.
+class compact_canvas : public canvas
+{
+public:
+    explicit compact_canvas(compact_format f);
+    compact_canvas(int w, int h, compact_format f);
+    // compact_indexed8 only: n (up to 256) colors as 0xRRGGBB, the rest
+    // black; by default 3 bits of red and green, 2 of blue
+    void set_palette(const int* rgb, int n);
+};
+
+
+// Canvas stored in tiles of 8 x 8 pixels (256 bytes) instead of rows, so
+// that a column touches one cache line per 8 rows, not one per row: faster
+// for vertical lines, tall glyph columns and sources rotated by affine_stamp.
+// Dots, lines, boxes, text, scroll() and stamps onto it or from it work on
+// the tiles; stamping it onto the window or a plain canvas converts the rows
+// on the way, and so does save(). Views of it lay it out in rows for good.
+// 32 bits per pixel.
+class tiled_canvas : public canvas
+{
+public:
+    tiled_canvas() { tiled = true; }
+    tiled_canvas(int w, int h) { tiled = true; open(w, h); }
+};
+
+
+// A rectangle of another canvas (or view), drawn on in place: local
+// coordinates, clipped to the rectangle, no copies. Views of views nest,
+// e.g. widgets drawing straight into their area of gout. Valid while the
+// parent keeps its pixels and its place: no open(), load(),
+// convert_to_native(), moving from it, or view() of a mapped_canvas.
+// Assigning to the parent copies into its pixels and keeps the views.
+// Copies of the parent get pixels of their own. A ring_canvas is seen as
+// stored, a tiled_canvas is turned into rows. Views of a 1 bit canvas
+// start at a multiple of 8 pixels. Copies are views of the same rectangle.
+class canvas_view : public canvas
+{
+public:
+    canvas_view(canvas& parent, int x, int y, int w, int h);
+    canvas_view(const canvas_view& v);
+    canvas_view& operator=(const canvas_view& v);
+    canvas& parent() const { return *owner; }
+    // position in the parent, after clipping
+    int left() const { return vx; }
+    int top() const { return vy; }
+
+private:
+    void attach(canvas& parent, int x, int y, int w, int h);
+    int vx, vy;
+};
+
+
+// Canvas stored in a file mapped into memory, for images too large for the
+// RAM or a single surface (maps, scans, 100000 x 100000 pixels). The file
+// holds 256 x 256 pixel tiles, the system reads them in and writes them
+// back as they are used. Drawing and stamping go to a viewport chosen with
+// view(), in its coordinates like a canvas_view, and touch only the tiles
+// it covers. A viewport inside one tile is drawn on in place, a larger one
+// is copied out and written back by the next view(), sync() and the
+// destructor. It starts as the top left tile. open(), load() and
+// convert_to_native() would replace the viewport, they do nothing and
+// return false. Images whose file would not fit in the address space are
+// refused (beyond about 4 GiB on 32 bit systems).
+class mapped_canvas : public canvas
+{
+public:
+    // the image in file, made by the other constructor
+    explicit mapped_canvas(const std::string& file);
+    // a new black image of w x h pixels, replacing file
+    mapped_canvas(const std::string& file, int w, int h);
+    ~mapped_canvas();
+    mapped_canvas(const mapped_canvas&) = delete;
+    mapped_canvas& operator=(const mapped_canvas&) = delete;
+    bool open(unsigned, unsigned) { return false; }
+    bool load(const std::string&) { return false; }
+    bool convert_to_native() { return false; }
+
+    bool is_open() const { return store != nullptr; }
+    // size of the whole image, width() and height() are those of the viewport
+    int full_width() const;
+    int full_height() const;
+    // the viewport, clipped to the image; the previous one is written back
+    void view(int x, int y, int w, int h);
+    int left() const { return vx; }
+    int top() const { return vy; }
+    // writes the viewport back and the changed tiles to the file
+    void sync();
+
+private:
+    void write_back();
+    std::shared_ptr<tile_store> store;
+    int vx, vy;
+    bool direct;            // buf is inside a tile
+    unsigned long synced;   // changes when the viewport was written back
+};
+
+
+// Packs many small canvases (icons, tiles, sprites) into one sheet, so that
+// they share a single surface instead of one allocation each. add() copies a
+// canvas in with a skyline packer and returns where it went; adding the
+// taller ones first packs tighter. Stamp the regions, or put them in a
+// stamp_batch of sheet(); transparent() of the sheet applies to all.
+class atlas
+{
+public:
+    atlas(int w, int h, bool with_alpha = false);
+    atlas(const atlas&) = delete;
+    atlas& operator=(const atlas&) = delete;
+    atlas_region add(const canvas& c);
+    canvas& sheet() { return *sheet_; }
+    // the part of the sheet in use, 0..1
+    double usage() const;
+
+private:
+    struct skyline_segment
+    {
+        int x, y, w;
+    };
+
+    std::shared_ptr<canvas> sheet_;
+    std::vector<skyline_segment> skyline;
+    long long used;
+};
+
+
+// Keeps an ordered stack of layer canvases, each with a position and
+// visibility, and on refresh() redraws only the parts of the target where
+// something changed: drawing on a layer, moving, showing or hiding it.
+// Drawing on a layer counts as a change of all of it, unless invalidate()
+// narrowed it down since the last refresh(). Uncovered areas are black.
+class compositor
+{
+public:
+    explicit compositor(canvas& target);
+    // a new top layer, transparent with alpha, black otherwise
+    int add_layer(int w, int h, int x = 0, int y = 0, bool with_alpha = false);
+    canvas& layer(int i) { return *layers[i].c; }
+    int layer_count() const { return static_cast<int>(layers.size()); }
+    void move_layer(int i, int x, int y);
+    void show_layer(int i, bool visible);
+    // in the coordinates of the layer
+    void invalidate(int i, int x, int y, int w, int h);
+    // all of the target, e.g. after drawing on it directly
+    void invalidate_all();
+    // composes the changed areas, then refreshes the target
+    void refresh();
+
+private:
+    struct layer_state
+    {
+        std::shared_ptr<canvas> c;
+        int x, y;
+        bool visible;
+        bool marked;            // invalidate() was called
+        unsigned long seen;     // canvas::changes at the last refresh
+    };
+    struct area
+    {
+        int x, y, w, h;
+    };
+
+    void damage(int x, int y, int w, int h);
+    void compose(const area& a);
+
+    canvas& out;
+    std::vector<layer_state> layers;
+    std::vector<area> dirty;
+};
+
+
+// How accumulator::resolve maps the sums (times the exposure) to 0..255:
+// cut off, or compressed so that bright areas keep some detail.
+enum tonemap_t {
+    tonemap_clamp, tonemap_reinhard, tonemap_exponential
+};
+
+// Sums additive light at 16 bits per channel, for glow, heat maps and long
+// exposures that would saturate a canvas at 255. Dots and canvases are
+// splatted in, the sums saturate at 65535; resolve() draws the tonemapped
+// result like a stamp, fade() darkens everything for trails.
+class accumulator
+{
+public:
+    accumulator(int w, int h);
+    int width() const { return w; }
+    int height() const { return h; }
+    void clear();
+    // multiplies every sum by f, 0..1
+    void fade(double f);
+    // what a dot adds, may be above 255
+    void set_color(int r, int g, int b);
+    void add_dot(int x, int y);
+    void add_dots(const int* xs, const int* ys, std::size_t n);
+    // adds the colors of c (premultiplied for an alpha_canvas), times weight / 255
+    void add(const canvas& c, int x, int y, int weight = 255);
+    void set_tonemap(tonemap_t t, double exposure = 1);
+    void resolve(canvas& out, int x = 0, int y = 0, blend_mode mode = blend_normal) const;
+
+private:
+    int w, h;
+    std::vector<unsigned short> sums;   // blue, green, red and a spare one per pixel
+    unsigned short dot[4];
+    tonemap_t tonemap;
+    double exposure;
+    std::vector<unsigned char> curve;   // the tonemap of every sum
+};
+
+
+// The solid pixels of a canvas, one bit each, every row packed into 64 bit
+// words: the non-black ones of a transparent() canvas, those with at least
+// the threshold alpha of an alpha_canvas, all of them otherwise. Made once
+// per sprite image; two masks are tested by ANDing shifted words of the rows
+// they share, instead of reading pixels.
+class collision_mask
+{
+public:
+    collision_mask();
+    explicit collision_mask(const canvas& c, int alpha_threshold = 128);
+    int width() const { return w; }
+    int height() const { return h; }
+    bool solid(int x, int y) const;
+    // whether this mask placed at x, y and o at ox, oy have a solid pixel in common
+    bool overlaps(int x, int y, const collision_mask& o, int ox, int oy) const;
+    // the box around the solid pixels, empty (left >= right) without any
+    int left() const { return x0; }
+    int top() const { return y0; }
+    int right() const { return x1; }
+    int bottom() const { return y1; }
+
+private:
+    unsigned long long word(int row, int i) const
+    { return i >= 0 && i < words ? bits[static_cast<std::size_t>(row) * words + i] : 0; }
+    unsigned long long bits_at(int row, int p) const;
+
+    int w, h;
+    int words;          // per row
+    std::vector<unsigned long long> bits;   // pixel x is bit x % 64 of word x / 64
+    int x0, y0, x1, y1;
+};
+
+// a mask where it is drawn, for find_collisions
+struct placed_mask
+{
+    const collision_mask* mask;
+    int x, y;
+    placed_mask(const collision_mask& m, int px, int py) : mask(&m), x(px), y(py) {}
+};
+
+// The pairs (i < j) of the items that overlap. The boxes of the solid
+// pixels are swept along x first, only the pairs whose boxes meet get
+// compared bit by bit.
+void find_collisions(const placed_mask* items, std::size_t n, std::vector<std::pair<int, int> >& hits);
+inline void find_collisions(const std::vector<placed_mask>& items, std::vector<std::pair<int, int> >& hits)
+{ find_collisions(items.empty() ? 0 : &items[0], items.size(), hits); }
 
 
 // Class of output device (singleton)
@@ -81,21 +558,74 @@ class groutput : public canvas
 public:
     static groutput& instance();
     virtual ~groutput();
+    groutput(const groutput&) = delete;
+    groutput& operator=(const groutput&) = delete;
 
     void showmouse(bool toggle);
     void movemouse(int x, int y);
     bool open(unsigned width, unsigned height, bool fullscreen=false);
+    // A window scale times the size of the canvas, for pixel art: drawing
+    // happens at width x height, refresh() enlarges that (nearest neighbour)
+    // and mouse events come in canvas coordinates.
+    bool open_scaled(unsigned width, unsigned height, int scale, bool fullscreen=false);
+    int scale() const { return zoom; }
     virtual void refresh();
 	void set_title(const std::string& title);
 
 private:
     SDL_Window *wnd;
+    SDL_Surface* screen;    // of the window, buf itself unless scaled
+    int zoom;
     groutput();
 };
 
 // Global accessor for the output device instance
 extern groutput& gout;
 
+
+// Grid of fixed size character cells, bound to a canvas. The cells use the
+// bitmap font of the canvas at construction time, or the built-in font.
+// Every cell stores a character, a foreground and a background color; draw()
+// repaints only the cells that changed since the previous draw().
+class textgrid
+{
+public:
+    textgrid(canvas& c, int cols, int rows, int x=0, int y=0);
+
+    int cols() const { return ncols; }
+    int rows() const { return nrows; }
+
+    void set_color(int r, int g, int b);
+    void set_background(int r, int g, int b);
+
+    // ch is a code point with a bitmap font, a Latin-1 byte otherwise
+    void put(int col, int row, unsigned ch);
+    void print(int col, int row, const std::string& str);
+    void clear();
+
+    void invalidate();
+    void draw();
+
+private:
+    struct cell
+    {
+        unsigned ch;
+        int fg, bg;
+    };
+
+    void store(int idx, unsigned ch);
+
+    canvas& out;
+    std::shared_ptr<bitmap_font> bmfont;
+    int ncols, nrows;
+    int left, top;
+    int cell_w, cell_h;
+    int fg_clr, bg_clr;
+    std::vector<cell> cells;
+    std::vector<unsigned char> dirty;
+    std::vector<int> dirty_cells;
+};
+
 // Generic operator for applying global manipulators
 template <typename Op>
 inline canvas& operator << (canvas& out, Op oper)
@@ -108,22 +638,88 @@ inline void dot(canvas& out) { out.draw_dot(); }
 
 struct stamp
 {
-    canvas &c;
+    const canvas* c;    // null for a region that did not fit, nothing is drawn
     int x1,y1,x2,y2,x3,y3;
-    stamp(canvas&cc, int sx1, int sy1, int xsize, int ysize, int tx1, int ty1) :
-        c(cc), x1(sx1), y1(sy1),x2(xsize), y2(ysize), x3(tx1), y3(ty1) {}
-    stamp(canvas&cc, int tx1, int ty1) :
-        c(cc), x1(-1), y1(-1),x2(-1), y2(-1), x3(tx1), y3(ty1) {}
+    blend_mode mode;
+    stamp(canvas&cc, int sx1, int sy1, int xsize, int ysize, int tx1, int ty1, blend_mode m = blend_normal) :
+        c(&cc), x1(sx1), y1(sy1),x2(xsize), y2(ysize), x3(tx1), y3(ty1), mode(m) {}
+    stamp(canvas&cc, int tx1, int ty1, blend_mode m = blend_normal) :
+        c(&cc), x1(-1), y1(-1),x2(-1), y2(-1), x3(tx1), y3(ty1), mode(m) {}
+    stamp(const atlas_region& r, int tx1, int ty1, blend_mode m = blend_normal) :
+        c(r.sheet), x1(r.x), y1(r.y),x2(r.w), y2(r.h), x3(tx1), y3(ty1), mode(m) {}
+    void operator () (canvas& out)
+    {
+        if (c)
+            out.blitfrom(*c,x1,y1,x2,y2,x3,y3,mode);
+    }
+};
+
+// stamp, scaled and rotated; the centre of the canvas goes to tx, ty
+// unless a pivot is given
+struct affine_stamp
+{
+    canvas &c;
+    int x1, y1, x2, y2;
+    double x3, y3, scale_x, scale_y, angle, pivot_x, pivot_y;
+    filter_mode filter;
+    blend_mode mode;
+    affine_stamp(canvas& cc, double tx, double ty, double scale, double ang = 0,
+                 filter_mode f = filter_nearest, blend_mode m = blend_normal) :
+        c(cc), x1(-1), y1(-1), x2(-1), y2(-1), x3(tx), y3(ty), scale_x(scale), scale_y(scale),
+        angle(ang), pivot_x(cc.width() / 2.0), pivot_y(cc.height() / 2.0), filter(f), mode(m) {}
+    affine_stamp(canvas& cc, int sx1, int sy1, int xsize, int ysize, double tx, double ty,
+                 double sx, double sy, double ang, double px, double py,
+                 filter_mode f = filter_nearest, blend_mode m = blend_normal) :
+        c(cc), x1(sx1), y1(sy1), x2(xsize), y2(ysize), x3(tx), y3(ty), scale_x(sx), scale_y(sy),
+        angle(ang), pivot_x(px), pivot_y(py), filter(f), mode(m) {}
+    void operator () (canvas& out)
+    { out.blit_transformed(c, x1, y1, x2, y2, x3, y3, scale_x, scale_y, angle, pivot_x, pivot_y, filter, mode); }
+};
+
+struct stamp_batch
+{
+    canvas &c;
+    const batch_item* items;
+    std::size_t n;
+    bool sort;
+    stamp_batch(canvas& sheet, const std::vector<batch_item>& list, bool sort_by_target = false) :
+        c(sheet), items(list.empty() ? 0 : &list[0]), n(list.size()), sort(sort_by_target) {}
+    stamp_batch(canvas& sheet, const batch_item* list, std::size_t count, bool sort_by_target = false) :
+        c(sheet), items(list), n(count), sort(sort_by_target) {}
+    void operator () (canvas& out)
+    { out.blit_batch(c, items, n, sort); }
+};
+
+// draws an accumulator, see accumulator::resolve
+struct resolve
+{
+    const accumulator& a;
+    int x, y;
+    blend_mode mode;
+    resolve(const accumulator& acc, int tx = 0, int ty = 0, blend_mode m = blend_normal) :
+        a(acc), x(tx), y(ty), mode(m) {}
     void operator () (canvas& out)
-    { out.blitfrom(c,x1,y1,x2,y2,x3,y3); }
+    { a.resolve(out, x, y, mode); }
+};
+
+struct scroll
+{
+    int dx, dy, x, y, w, h;
+    bool fill;
+    scroll(int sdx, int sdy, bool f=false) :
+        dx(sdx), dy(sdy), x(0), y(0), w(-1), h(-1), fill(f) {}
+    scroll(int sdx, int sdy, int rx, int ry, int rw, int rh, bool f=false) :
+        dx(sdx), dy(sdy), x(rx), y(ry), w(rw), h(rh), fill(f) {}
+    void operator () (canvas& out)
+    { out.scroll(dx, dy, x, y, w, h, fill); }
 };
 
 struct color
 {
-    int red, green, blue;
-    color(int r, int g, int b) : red(r), green(g), blue(b) {}
+    int red, green, blue, alpha;
+    color(int r, int g, int b, int a = 255) : red(r), green(g), blue(b), alpha(a) {}
     void operator () (canvas& out)
-    { out.set_color(red, green, blue); }
+    { out.set_color(red, green, blue, alpha); }
 };
 
 
@@ -179,11 +775,61 @@ struct box_to
 struct text
 {
     std::string str;
-    text(const std::string& s) : str(s) {}
-    text(char c) : str(1, c) {}
+    const char *first, *last;
+    text(const std::string& s) : str(s), first(0), last(0) {}
+    text(char c) : str(1, c), first(0), last(0) {}
+    // integers are characters, as before the pointer overloads; so text(0)
+    // is the character 0, not a null string
+    text(int c) : str(1, static_cast<char>(c)), first(0), last(0) {}
+    // The following ones only refer to the characters, they must stay
+    // valid until the manipulator is applied. There is no null string.
+    text(const char* s) : first(s), last(s + std::strlen(s)) {}
+    text(std::nullptr_t) = delete;
+    text(const char* b, const char* e) : first(b), last(e) {}
+#ifdef GENV_HAS_STRING_VIEW
+    text(std::string_view s) : first(s.data()), last(s.data() + s.size()) {}
+#endif
+    void operator () (canvas& out)
+    {
+        if (first)
+            out.draw_text(first, last - first);
+        else
+            out.draw_text(str);
+    }
+};
+
+// Prints a number, right aligned to at least 'width' characters.
+// The digits are formatted into the manipulator itself, not on the heap.
+struct number
+{
+    char buf[40];
+    int len;
+    number(int v, int width=0);
+    number(long v, int width=0);
+    number(long long v, int width=0);
+    number(unsigned v, int width=0);
+    number(unsigned long v, int width=0);
+    number(unsigned long long v, int width=0);
+    // precision < 0 prints the shortest form (%g)
+    number(double v, int precision=-1, int width=0);
+    void operator () (canvas& out)
+    { out.draw_text(buf, len); }
+
+private:
+    void format_int(unsigned long long v, bool neg, int width);
+};
+
+// printf style formatted text, at most 127 bytes, in a stack buffer. Longer
+// text is cut before the UTF-8 character that does not fit.
+struct textf
+{
+    char buf[128];
+    int len;
+    textf(const char* fmt, ...) GENV_PRINTF(2, 3);
     void operator () (canvas& out)
-    { out.draw_text(str); }
+    { out.draw_text(buf, len); }
 };
+
 /*
 struct title
 {
@@ -197,11 +843,14 @@ struct title
 struct font
 {
     std::string font_name;
+    const char* name;
     int font_size;
     bool antialias;
-    font(const std::string& s, int fs, bool a=true) : font_name(s), font_size(fs), antialias(a) {}
+    font(const std::string& s, int fs, bool a=true) : font_name(s), name(0), font_size(fs), antialias(a) {}
+    // refers to the file name without copying it
+    font(const char* s, int fs, bool a=true) : name(s), font_size(fs), antialias(a) {}
     void operator () (canvas& out)
-    { out.load_font(font_name, font_size, antialias); }
+    { out.load_font(name ? name : font_name.c_str(), font_size, antialias); }
 };
 
 
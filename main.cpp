@@ -11,13 +11,6 @@ using namespace std;
 const int X=640;
 const int Y=480;
 
-template <typename T>
-string to_str(const T& a) {
-    stringstream ss;
-    ss << a;
-    return ss.str();
-}
-
 int main()
 {
     gout.open(X, Y);
@@ -161,9 +154,8 @@ int main()
     gout << move_to(0,0) << color(0,0,0) << box(X,Y) << color(255,255,255) << refresh;
     while (gin>>ev && ev.keycode != key_escape) {
         if (ev.type == ev_key) {
-            gout << stamp(gout, 0,0,X,Y-40, 0, 40);
-            gout << color(0,0,0) << move_to(0,0) << box(X,40) << color(255,255,255);
-            gout << move_to(30,20) << text(to_str(ev.keycode));
+            gout << color(0,0,0) << scroll(0, 40, true) << color(255,255,255);
+            gout << move_to(30,20) << number(ev.keycode);
             gout << refresh;
         }
     }
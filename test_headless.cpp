@@ -0,0 +1,265 @@
+// Checks of the pixel paths that need no window: run with
+// SDL_VIDEODRIVER=dummy (ctest sets it). Prints the failed checks and
+// returns their count.
+#include "graphics.hpp"
+#include <cstdio>
+#include <vector>
+#include <utility>
+
+using namespace genv;
+
+namespace
+{
+    int failures = 0;
+
+#define CHECK(cond) \
+    do { if (!(cond)) { std::printf("%s:%d: %s\n", __FILE__, __LINE__, #cond); ++failures; } } while (0)
+
+    // a plain canvas that can read its own pixels; others are stamped in
+    struct probe : canvas
+    {
+        probe(int w, int h) : canvas(w, h) {}
+        probe(canvas& c, int w, int h) : canvas(w, h) { *this << stamp(c, 0, 0); }
+        unsigned at(int x, int y) const { return value_at(x, y) & 0xffffff; }
+    };
+
+    unsigned rgb(int r, int g, int b)
+    {
+        return static_cast<unsigned>(r) << 16 | static_cast<unsigned>(g) << 8 | static_cast<unsigned>(b);
+    }
+
+    // 16.16 sample positions of a source wider than 32767 pixels
+    void check_affine_wide()
+    {
+        const int w = 40000;
+        canvas src(w, 2);
+        for (int k = 0; k < 40; ++k)
+            src << move_to(k * 1000, 0) << color(k * 6, 255 - k * 6, 7) << box(1000, 2);
+        for (int f = 0; f < 2; ++f)
+        {
+            probe dst(400, 2);
+            dst << affine_stamp(src, 0, 0, w, 2, 0.0, 0.0, 0.01, 1.0, 0.0, 0.0, 0.0,
+                                f ? filter_bilinear : filter_nearest);
+            for (int k = 0; k < 40; ++k)
+                CHECK(dst.at(k * 10 + 5, 0) == rgb(k * 6, 255 - k * 6, 7));
+        }
+    }
+
+    // scattered dots on transparent black, the same for the same seed
+    void speckle(canvas& c, unsigned seed)
+    {
+        c.transparent(true);
+        c << move_to(0, 0) << color(0, 0, 0) << box(c.width(), c.height()) << color(255, 255, 255);
+        for (int y = 0; y < c.height(); ++y)
+            for (int x = 0; x < c.width(); ++x)
+            {
+                seed = seed * 1103515245u + 12345u;
+                if ((seed >> 16) % 7 == 0)
+                    c << move_to(x, y) << dot;
+            }
+    }
+
+    // the shifted word compares of overlaps() against pixel by pixel, also
+    // across the 64 bit words of the rows
+    void check_collision_shifts()
+    {
+        canvas a(150, 20), b(70, 13);
+        speckle(a, 1);
+        speckle(b, 2);
+        collision_mask ma(a), mb(b);
+        probe pa(a, 150, 20);
+        for (int x = 0; x < 150; ++x)
+            CHECK(ma.solid(x, 7) == (pa.at(x, 7) != 0));
+        for (int oy = -14; oy <= 21; oy += 5)
+            for (int ox = -72; ox <= 152; ++ox)
+            {
+                bool hit = false;
+                for (int y = 0; y < mb.height() && !hit; ++y)
+                    for (int x = 0; x < mb.width() && !hit; ++x)
+                    {
+                        int ax = ox + x, ay = oy + y;
+                        hit = mb.solid(x, y) && ax >= 0 && ay >= 0 && ax < ma.width() && ay < ma.height() && ma.solid(ax, ay);
+                    }
+                CHECK(ma.overlaps(0, 0, mb, ox, oy) == hit);
+                CHECK(mb.overlaps(ox, oy, ma, 0, 0) == hit);
+            }
+    }
+
+    // a color that compact_format f stores exactly, for column x
+    unsigned exact_color(int f, int x)
+    {
+        switch (f) {
+        case compact_rgb565: {
+            int r = x % 32, g = x * 3 % 64, b = 31 - x % 32;
+            return rgb(r << 3 | r >> 2, g << 2 | g >> 4, b << 3 | b >> 2);
+        }
+        case compact_gray8:
+            return x * 5 * 0x010101u;
+        case compact_indexed8: {
+            int i = x * 5 % 256;    // of the default 3-3-2 palette
+            return rgb((i >> 5) * 255 / 7, ((i >> 2) & 7) * 255 / 7, (i & 3) * 255 / 3);
+        }
+        default:
+            return x % 3 ? 0xffffff : 0;
+        }
+    }
+
+    // every compact format expanded onto a 32 bit canvas, from the start of
+    // a row and from inside a byte of a 1 bit row, across the SIMD widths
+    void check_compact_expand()
+    {
+        const int w = 45;
+        for (int f = compact_rgb565; f <= compact_mask1; ++f)
+        {
+            compact_canvas c(w, 3, static_cast<compact_format>(f));
+            for (int x = 0; x < w; ++x)
+            {
+                unsigned v = exact_color(f, x);
+                c << move_to(x, 0) << color(v >> 16, (v >> 8) & 0xff, v & 0xff) << box(1, 3);
+            }
+            probe p(c, w, 3);
+            p << stamp(c, 5, 1, w - 5, 2, 1, 0);
+            for (int x = 0; x < w; ++x)
+            {
+                CHECK(p.at(x, 2) == exact_color(f, x));
+                CHECK(p.at(x, 0) == (x >= 1 && x < w - 4 ? exact_color(f, x + 4) : exact_color(f, x)));
+            }
+        }
+    }
+
+    void scene(canvas& c)
+    {
+        c << move_to(0, 0) << color(10, 20, 30) << box(c.width(), c.height());
+        for (int x = 0; x < c.width(); x += 3)
+            c << move_to(x, 1) << color(x * 4, 200, 255 - x * 4) << line(0, c.height() - 3);
+        c << move_to(5, 7) << color(250, 250, 0) << box(17, 11) << move_to(2, 3) << text("Tiles");
+        c << scroll(3, -2, true) << scroll(-5, 4, 10, 9, 30, 15, true);
+    }
+
+    bool same(canvas& a, canvas& b)
+    {
+        probe pa(a, a.width(), a.height()), pb(b, b.width(), b.height());
+        for (int y = 0; y < a.height(); ++y)
+            for (int x = 0; x < a.width(); ++x)
+                if (pa.at(x, y) != pb.at(x, y))
+                    return false;
+        return a.width() == b.width() && a.height() == b.height();
+    }
+
+    // the 8x8 tile layout against rows: drawing, partial stamps both ways,
+    // and a BMP file in between, with edges that are not whole tiles
+    void check_tiles()
+    {
+        canvas rows(61, 29);
+        tiled_canvas tiles(61, 29);
+        scene(rows);
+        scene(tiles);
+        CHECK(same(rows, tiles));
+        probe a(70, 40), b(70, 40);
+        a << stamp(rows, 3, 5, 50, 20, 9, 11);
+        b << stamp(tiles, 3, 5, 50, 20, 9, 11);
+        CHECK(same(a, b));
+        tiled_canvas t2(70, 40);
+        t2 << stamp(a, 0, 0) << stamp(tiles, 13, 2, 40, 25, 1, 6);
+        a << stamp(rows, 13, 2, 40, 25, 1, 6);
+        CHECK(same(a, t2));
+        CHECK(tiles.save("test_headless.bmp"));
+        tiled_canvas loaded;
+        CHECK(loaded.load("test_headless.bmp") && same(loaded, rows));
+        std::remove("test_headless.bmp");
+    }
+
+    // a mapped_canvas file over several 256 x 256 tiles: viewports inside
+    // one tile and across tiles, written back and opened again
+    void check_mapped_tiles()
+    {
+        canvas ref(600, 300);
+        {
+            mapped_canvas m("test_headless.tiles", 600, 300);
+            CHECK(m.is_open() && m.full_width() == 600);
+            m.view(200, 200, 300, 90);
+            CHECK(m.width() == 300 && m.height() == 90);
+            scene(m);
+            ref << stamp(m, 200, 200);
+            m.view(10, 10, 100, 100);
+            m << move_to(0, 0) << color(1, 2, 3) << box(50, 50);
+            ref << move_to(10, 10) << color(1, 2, 3) << box(50, 50);
+        }
+        {
+            mapped_canvas m("test_headless.tiles");
+            CHECK(m.is_open() && m.full_height() == 300);
+            m.view(0, 0, 600, 300);
+            CHECK(same(m, ref));
+        }
+        std::remove("test_headless.tiles");
+    }
+
+    // copies share the pixels until one of them draws; moves and
+    // assignments keep views working
+    void check_sharing()
+    {
+        canvas a(20, 10);
+        a << move_to(0, 0) << color(9, 9, 9) << box(20, 10);
+        canvas b(a), c;
+        c = b;
+        a << move_to(1, 1) << color(200, 0, 0) << dot;
+        b << move_to(2, 2) << color(0, 200, 0) << dot;
+        CHECK(probe(a, 20, 10).at(1, 1) == rgb(200, 0, 0) && probe(a, 20, 10).at(2, 2) == rgb(9, 9, 9));
+        CHECK(probe(b, 20, 10).at(1, 1) == rgb(9, 9, 9) && probe(b, 20, 10).at(2, 2) == rgb(0, 200, 0));
+        CHECK(probe(c, 20, 10).at(1, 1) == rgb(9, 9, 9) && probe(c, 20, 10).at(2, 2) == rgb(9, 9, 9));
+
+        std::vector<canvas> v;
+        for (int i = 0; i < 20; ++i)
+        {
+            v.push_back(canvas(4, 4));
+            v.back() << move_to(0, 0) << color(i, i, i) << box(4, 4);
+        }
+        for (int i = 0; i < 20; ++i)
+            CHECK(probe(v[i], 4, 4).at(3, 3) == rgb(i, i, i));
+
+        canvas_view view(a, 5, 2, 10, 5);
+        canvas moved(std::move(view));
+        moved << move_to(0, 0) << color(1, 2, 3) << dot;
+        CHECK(moved.width() == 10 && probe(a, 20, 10).at(5, 2) == rgb(1, 2, 3));
+        canvas_view other(a, 0, 0, 4, 4);
+        a = c;
+        CHECK(a.width() == 20);
+        other << move_to(3, 3) << color(4, 5, 6) << dot;
+        CHECK(probe(a, 20, 10).at(3, 3) == rgb(4, 5, 6) && probe(c, 20, 10).at(3, 3) == rgb(9, 9, 9));
+    }
+
+    // a ring_canvas scrolled as a whole moves its origin, stamping it
+    // composes the wrapped pieces
+    void check_ring()
+    {
+        ring_canvas r(37, 23);
+        canvas c(37, 23);
+        scene(r);
+        scene(c);
+        for (int i = 0; i < 9; ++i)
+        {
+            int dx = i * 5 % 11 - 5, dy = i * 3 % 7 - 3;
+            r << scroll(dx, dy, true) << move_to(i, i) << color(i * 20, 0, 0) << box(3, 3);
+            c << scroll(dx, dy, true) << move_to(i, i) << color(i * 20, 0, 0) << box(3, 3);
+            CHECK(same(r, c));
+        }
+        probe a(30, 20), b(30, 20);
+        a << stamp(r, 4, 3, 25, 17, 2, 1);
+        b << stamp(c, 4, 3, 25, 17, 2, 1);
+        CHECK(same(a, b));
+    }
+}
+
+int main()
+{
+    check_affine_wide();
+    check_collision_shifts();
+    check_compact_expand();
+    check_tiles();
+    check_mapped_tiles();
+    check_sharing();
+    check_ring();
+    if (failures)
+        std::printf("%d checks failed\n", failures);
+    return failures != 0;
+}